@@ -171,14 +171,16 @@ Node* Node::currentNode() {
       name =
           strdup("Worker #XXX - 0xXXXXXXXXXXXXXXXX");  // Worker ID - enclosing
       assert(name);
-      // Avec toyrt, les threads 1 et 2 ne sont pas des workers, ce sont les
-      // threads IO & MPI
+      // Avec toyrt, les threads 1, 2 et 3 ne sont pas des workers, ce sont les
+      // threads IO, MPI & memoire
       if (index == 1)
         sprintf(name, "Worker IO - %p", enclosing);
       else if (index == 2)
         sprintf(name, "Worker MPI - %p", enclosing);
+      else if (index == 3)
+        sprintf(name, "Worker Mem - %p", enclosing);
       else
-        sprintf(name, "Worker #%03d - %p", index - 2, enclosing);
+        sprintf(name, "Worker #%03d - %p", index - 3, enclosing);
     }
     current = new Node(name, NULL);
     currentNodes[index][enclosing] = current;
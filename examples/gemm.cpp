@@ -13,6 +13,7 @@
 #include "context/context.hpp"
 #include "data.hpp"
 #include "dependencies.hpp"
+#include "distribution.hpp"
 #include "task.hpp"
 
 typedef double scalar_t;
@@ -89,6 +90,7 @@ public:
   }
   size_t rows() const { return rows_; }
   size_t cols() const { return cols_; }
+  scalar_t* data() { return mat_.get(); }
 
   void scale(const scalar_t alpha) {
     DECLARE_CONTEXT;
@@ -203,19 +205,25 @@ void tiledGemm(Tiles& c, scalar_t alpha, const Tiles& a, const Tiles& b,
 
 /** Runtime stuff */
 
-/** Very simple data class that doesn't work wth MPI and OOC. */
-class SimpleData : public Data {
+/** Tile of a matrix. Every rank has storage for all the tiles, so the data
+    are never deallocated. */
+class MatrixData : public Data {
 public:
-  SimpleData() : Data() {}
-  ssize_t pack(void** ptr) override { return 0; }
-  void unpack(void* ptr, ssize_t count) override {}
+  MatrixData(const std::unique_ptr<Matrix>& m) : Data(), m(m.get()) {}
+  ssize_t pack(void** ptr) override {
+    if (ptr) {
+      *ptr = malloc(size());
+      assert(*ptr);
+      memcpy(*ptr, m->data(), size());
+    }
+    return size();
+  }
+  void unpack(void* ptr, ssize_t count) override {
+    assert(count == (ssize_t)size());
+    memcpy(m->data(), ptr, count);
+  }
   void deallocate() override {}
-  size_t size() override { return 0; }
-};
-
-class MatrixData : public SimpleData {
-public:
-  MatrixData(const std::unique_ptr<Matrix>& m) : SimpleData(), m(m.get()) {}
+  size_t size() override { return m->rows() * m->cols() * sizeof(scalar_t); }
 
 private:
   Matrix* m;
@@ -252,33 +260,48 @@ public:
   }
 };
 
+// The tiles are distributed with dist, and each task runs on the owner of
+// the tile of c it writes. On return, the tiles of c are only up to date on
+// their owner.
 void runtimeGemm(Tiles& c, scalar_t alpha, const Tiles& a, const Tiles& b,
-                 scalar_t beta, int nTiles)  {
+                 scalar_t beta, int nTiles, const Distribution& dist)  {
   DECLARE_CONTEXT;
   int nnTiles = nTiles * nTiles;
   std::vector<MatrixData> cData(c.begin(), c.begin() + nnTiles);
   std::vector<MatrixData> aData(a.begin(), a.begin() + nnTiles);
   std::vector<MatrixData> bData(b.begin(), b.begin() + nnTiles);
   TaskScheduler& s = TaskScheduler::getInstance();
-  s.setMpiComm(MPI_COMM_WORLD);
+  int tag = 1;
+  for (auto* tiles : {&cData, &aData, &bData}) {
+    tag = dist.distribute(nTiles, nTiles, [tiles, nTiles](int i, int j) {
+      return (Data*)&(*tiles)[i + j * nTiles];
+    }, tag);
+  }
   for (int j = 0; j < nTiles; j++) {
     for (int i = 0; i < nTiles; i++) {
       Matrix& c_ij = *c[i + j * nTiles];
-      s.insertTask(std::unique_ptr<Task>(new ScaleTask(beta, c_ij)),
-                   {{&cData[i + j * nTiles], toyRT_WRITE}});
+      toyRT_DepsArray params = {{&cData[i + j * nTiles], toyRT_WRITE}};
+      s.insertMpiTask(std::unique_ptr<Task>(new ScaleTask(beta, c_ij)),
+                      params, ownerComputes(params));
       for (int k = 0; k < nTiles; k++) {
         Matrix& a_ik = *a[i + k * nTiles];
         Matrix& b_kj = *b[k + j * nTiles];
         auto task =
           std::unique_ptr<Task>(new GemmTask(c_ij, alpha, a_ik, b_kj, 1.));
-        s.insertTask(std::move(task),
-                     {{&cData[i + j * nTiles], toyRT_WRITE},
-                      {&aData[i + k * nTiles], toyRT_READ},
-                      {&bData[k + j * nTiles], toyRT_READ}});
+        params = {{&cData[i + j * nTiles], toyRT_WRITE},
+                  {&aData[i + k * nTiles], toyRT_READ},
+                  {&bData[k + j * nTiles], toyRT_READ}};
+        s.insertMpiTask(std::move(task), params, ownerComputes(params));
       }
     }
   }
   s.go(4); // 4 threads
+  MpiDataCache& cache = MpiRequestPool::getInstance().cache;
+  for (auto* tiles : {&cData, &aData, &bData}) {
+    for (auto& d : *tiles) {
+      cache.eraseData(&d);
+    }
+  }
 }
 
 
@@ -288,18 +311,30 @@ int main(int argc, char** argv) {
     tracing_set_worker_index_func(toyrtWorkerId);
 
     MPI_Init(&argc, &argv);
-    if (argc != 3) {
-      std::cout << "Usage: " << argv[0] << " N ntiles" << std::endl;
+    if ((argc != 3) && (argc != 4)) {
+      std::cout << "Usage: " << argv[0] << " N ntiles [cacheSize]" << std::endl;
+      MPI_Finalize();
       return 0;
     }
+    TaskScheduler& s = TaskScheduler::getInstance();
+    s.setMpiComm(MPI_COMM_WORLD);
+    const int rank = s.getMpiRank();
     int n = atoi(argv[1]);
     int nTiles = atoi(argv[2]);
+    // Budget of the copies of remote tiles on each rank, in bytes.
+    MpiDataCache& cache = MpiRequestPool::getInstance().cache;
+    if (argc == 4) {
+      cache.capacity = atol(argv[3]);
+    }
     assert(n % nTiles == 0);
 
     std::cout << "Creating random a... "<< std::endl;
     Matrix a = Matrix::random(n, n);
     std::cout << "Creating random b... "<< std::endl;
     Matrix b = Matrix::random(n, n);
+    // Same inputs on all the ranks, to check the tiles computed locally.
+    MPI_Bcast(a.data(), n * n, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(b.data(), n * n, MPI_DOUBLE, 0, MPI_COMM_WORLD);
     std::cout << "Creating c... "<< std::endl;
     Matrix c(n, n);
     std::cout << "Creating c2... "<< std::endl;
@@ -315,18 +350,31 @@ int main(int argc, char** argv) {
     std::cout << "Splitting c2 into tiles... "<< std::endl;
     Tiles cTiles = toTiles(c2, nTiles);
     std::cout << "Computing a.b -> c2 in parallel "<< std::endl;
-    runtimeGemm(cTiles, 1, aTiles, bTiles, 0, nTiles);
+    BlockCyclic2D dist(s.getMpiSize());
+    runtimeGemm(cTiles, 1, aTiles, bTiles, 0, nTiles, dist);
     // tiledGemm(cTiles, 1, aTiles, bTiles, 0, nTiles);
-    std::cout << "Gathering c2 from tiles... "<< std::endl;
-    fromTiles(c2, cTiles, nTiles);
-
-    std::cout << "Checking result... "<< std::endl;
-    std::cout << "||C||  = " << c.norm() << "\n"
-              << "||C2|| = " << c2.norm() << std::endl;
-    assert(c.almostEquals(c2, 1e-15));
-    assert(c == c2);
+
+    std::cout << "Checking the local tiles... "<< std::endl;
+    Tiles refTiles = toTiles(c, nTiles);
+    for (int j = 0; j < nTiles; j++) {
+      for (int i = 0; i < nTiles; i++) {
+        if (dist.owner(i, j) == rank) {
+          const Matrix& tile = *cTiles[i + j * nTiles];
+          const Matrix& ref = *refTiles[i + j * nTiles];
+          assert(ref.almostEquals(tile, 1e-15));
+          assert(ref == tile);
+        }
+      }
+    }
+    std::cout << "||C||  = " << c.norm() << std::endl;
+    if (rank == 0) {
+      std::cout << "Cache hit rate = " << cache.hitRate() << " ("
+                << cache.hits << " hits, " << cache.misses << " misses, "
+                << cache.evictions << " evictions)" << std::endl;
+    }
   }
   tracing_dump("gemm_trace.json");
+  MPI_Finalize();
 
   return 0;
 }
@@ -0,0 +1,129 @@
+/** Micro-benchmark of the intrusive Lru<Data> against the former map-based
+    implementation.
+
+    The access pattern mimics the runtime: the data are all inserted, then each
+    one is repeatedly taken out of the LRU (startPrefetch()) and put back as the
+    most recent (postTaskExecutionInternal()), and finally everything is
+    evicted with removeOldest().
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include "data.hpp"
+#include "lru.hpp"
+
+/** The previous Lru<V>, kept here as a reference point. */
+template <typename V>
+class MapLru {
+ private:
+  int64_t current;
+  std::unordered_map<V*, int64_t> toSequence;
+  std::map<int64_t, V*> fromSequence;
+
+ public:
+  MapLru() : current(0), toSequence(), fromSequence() {}
+
+  void put(V* v) {
+    auto toIt = toSequence.find(v);
+    if (toIt != toSequence.end()) {
+      auto fromIt = fromSequence.find(toIt->second);
+      fromSequence.erase(fromIt);
+    }
+    int64_t sequence = current;
+    toSequence[v] = sequence;
+    fromSequence[sequence] = v;
+    ++current;
+  }
+  bool remove(V* v) {
+    auto toIt = toSequence.find(v);
+    if (toIt == toSequence.end()) {
+      return false;
+    }
+    fromSequence.erase(fromSequence.find(toIt->second));
+    toSequence.erase(toIt);
+    return true;
+  }
+  V* removeOldest() {
+    auto it = fromSequence.begin();
+    if (it == fromSequence.end()) {
+      return NULL;
+    }
+    V* result = it->second;
+    toSequence.erase(it->second);
+    fromSequence.erase(it->first);
+    return result;
+  }
+};
+
+class BenchData : public Data {
+ public:
+  ssize_t pack(void**) override { return 0; }
+  void unpack(void*, ssize_t) override {}
+  void deallocate() override {}
+  size_t size() override { return 0; }
+};
+
+typedef std::chrono::high_resolution_clock Clock;
+
+static double seconds(Clock::time_point start, Clock::time_point stop) {
+  return std::chrono::duration<double>(stop - start).count();
+}
+
+template <typename L>
+static void run(const char* name, std::vector<BenchData>& data,
+                const std::vector<int>& order, int rounds) {
+  L lru;
+  auto t0 = Clock::now();
+  for (auto& d : data) {
+    lru.put(&d);
+  }
+  auto t1 = Clock::now();
+  for (int r = 0; r < rounds; r++) {
+    for (int i : order) {
+      lru.remove(&data[i]);
+      lru.put(&data[i]);
+    }
+  }
+  auto t2 = Clock::now();
+  size_t evicted = 0;
+  while (lru.removeOldest()) {
+    evicted++;
+  }
+  auto t3 = Clock::now();
+  if (evicted != data.size()) {
+    std::cerr << name << ": evicted " << evicted << " items instead of "
+              << data.size() << std::endl;
+    exit(1);
+  }
+  const double n = data.size();
+  std::cout << name << ": put " << 1e9 * seconds(t0, t1) / n << " ns/op, "
+            << "remove+put " << 1e9 * seconds(t1, t2) / (n * rounds)
+            << " ns/op, removeOldest " << 1e9 * seconds(t2, t3) / n
+            << " ns/op, total " << seconds(t0, t3) << " s" << std::endl;
+}
+
+int main(int argc, char** argv) {
+  int n = (argc > 1 ? atoi(argv[1]) : 1000000);
+  int rounds = (argc > 2 ? atoi(argv[2]) : 4);
+  std::cout << "Tracking " << n << " items, " << rounds << " refresh rounds"
+            << std::endl;
+
+  std::vector<BenchData> data(n);
+  std::vector<int> order(n);
+  for (int i = 0; i < n; i++) {
+    order[i] = i;
+  }
+  std::mt19937 rgen(42);
+  std::shuffle(order.begin(), order.end(), rgen);
+
+  run<MapLru<Data> >("map-based Lru", data, order, rounds);
+  run<Lru<Data> >("intrusive Lru", data, order, rounds);
+  return 0;
+}
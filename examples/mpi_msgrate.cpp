@@ -0,0 +1,153 @@
+/** MPI message rate benchmark for runtime.
+
+    Each rank owns some blocks, written by a task on their owner and then read
+    by a task on the next rank, so that each block is a message from a worker
+    of its owner. The rate is measured with the requests posted by the MPI
+    thread (MPI_THREAD_SERIALIZED), or by the workers themselves
+    (MPI_THREAD_MULTIPLE, see MpiRequestPool::threadMultiple). Run with any
+    number of processes, 2 or more:
+
+    mpirun -np 2 ./mpi_msgrate [messages] [size] [threadMultiple] [workers]
+
+    The messages are larger than the aggregation threshold by default, so that
+    they are not batched.
+ */
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include <mpi.h>
+
+#include "context/context.hpp"
+#include "data.hpp"
+#include "dependencies.hpp"
+#include "task.hpp"
+
+/** Array of bytes, allocated on demand. */
+class Block : public Data {
+ public:
+  Block(size_t n) : Data(), n(std::max(n, sizeof(int64_t))), ptr(NULL) {}
+  ~Block() { free(ptr); }
+  ssize_t pack(void** out) override {
+    if (out) {
+      *out = malloc(n);
+      assert(*out);
+      memcpy(*out, ptr, n);
+    }
+    return n;
+  }
+  void unpack(void* in, ssize_t count) override {
+    assert(count == (ssize_t)n);
+    allocate();
+    memcpy(ptr, in, count);
+  }
+  void deallocate() override {
+    free(ptr);
+    ptr = NULL;
+  }
+  size_t size() override { return n; }
+  void allocate() {
+    if (!ptr) {
+      ptr = (char*)calloc(n, 1);
+      assert(ptr);
+    }
+  }
+  int64_t& value() { return *(int64_t*)ptr; }
+
+ public:
+  const size_t n;
+  char* ptr;
+};
+
+class WriteTask : public Task {
+ private:
+  Block& b;
+  int64_t value;
+
+ public:
+  WriteTask(Block& b, int64_t value) : Task("write"), b(b), value(value) {}
+  void call() override {
+    b.allocate();
+    b.value() = value;
+  }
+};
+
+class CheckTask : public Task {
+ private:
+  Block& b;
+  int64_t value;
+
+ public:
+  CheckTask(Block& b, int64_t value) : Task("check"), b(b), value(value) {}
+  void call() override {
+    assert(b.value() == value);
+    (void)value;
+  }
+};
+
+int main(int argc, char** argv) {
+  DECLARE_CONTEXT;
+  tracing_set_worker_index_func(toyrtWorkerId);
+
+  const int messages = (argc > 1 ? atoi(argv[1]) : 10000);
+  const size_t size = (argc > 2 ? atol(argv[2]) : 8192);
+  const bool multiple = (argc > 3 ? atoi(argv[3]) : 0);
+  const int workers = (argc > 4 ? atoi(argv[4]) : 2);
+
+  int provided;
+  MPI_Init_thread(&argc, &argv,
+                  multiple ? MPI_THREAD_MULTIPLE : MPI_THREAD_SERIALIZED,
+                  &provided);
+  TaskScheduler& s = TaskScheduler::getInstance();
+  s.setMpiComm(MPI_COMM_WORLD);
+  const int rank = s.getMpiRank();
+  const int ranks = s.getMpiSize();
+  if (ranks < 2) {
+    std::cout << "Usage: mpirun -np 2 " << argv[0]
+              << " [messages] [size] [threadMultiple] [workers]" << std::endl;
+    MPI_Finalize();
+    return 1;
+  }
+  if (multiple && (provided != MPI_THREAD_MULTIPLE) && (rank == 0)) {
+    std::cout << "MPI_THREAD_MULTIPLE not provided, using the MPI thread"
+              << std::endl;
+  }
+  MpiRequestPool::getInstance().threadMultiple = multiple;
+
+  std::vector<std::unique_ptr<Block>> blocks;
+  for (int owner = 0; owner < ranks; owner++) {
+    for (int i = 0; i < messages; i++) {
+      blocks.emplace_back(new Block(size));
+      Block& b = *blocks.back();
+      b.rank = owner;
+      b.tag = (int)blocks.size();
+      s.insertMpiTask(new WriteTask(b, b.tag), {{&b, toyRT_WRITE}}, owner);
+      s.insertMpiTask(new CheckTask(b, b.tag), {{&b, toyRT_READ}},
+                      (owner + 1) % ranks);
+    }
+  }
+  MPI_Barrier(MPI_COMM_WORLD);
+  auto start = std::chrono::high_resolution_clock::now();
+  s.go(workers);
+  auto stop = std::chrono::high_resolution_clock::now();
+  for (auto& b : blocks) {
+    MpiRequestPool::getInstance().cache.eraseData(b.get());
+  }
+  double time = std::chrono::duration<double>(stop - start).count();
+  double maxTime;
+  MPI_Reduce(&time, &maxTime, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+  if (rank == 0) {
+    std::cout << "# mode, messages per rank, bytes, time (s), messages/s"
+              << std::endl
+              << (multiple ? "multiple " : "serialized ") << messages << " "
+              << size << " " << maxTime << " "
+              << (double)messages * ranks / maxTime << std::endl;
+  }
+  MPI_Finalize();
+  return 0;
+}
@@ -0,0 +1,134 @@
+/** MPI ping-pong benchmark for runtime.
+
+    A buffer owned by rank 0 is written alternately by a task on rank 1 and a
+    task on rank 0, so that each round trip is a transfer from 0 to 1 and back,
+    going through the whole task and communication machinery. Run with 2
+    processes:
+
+    mpirun -np 2 ./mpi_pingpong [rounds] [maxSize] [chunked]
+
+    With chunked = 1 (the default), the buffer is packed by ranges and the
+    large transfers are pipelined by chunks.
+ */
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <mpi.h>
+
+#include "context/context.hpp"
+#include "data.hpp"
+#include "dependencies.hpp"
+#include "task.hpp"
+
+/** Buffer of bytes, whose first 8 bytes are a counter. */
+class Buffer : public Data {
+ public:
+  Buffer(size_t n, bool chunked)
+      : Data(), n(std::max(n, sizeof(int64_t))), ptr(NULL), chunked(chunked) {
+    ptr = (char*)calloc(this->n, 1);
+    assert(ptr);
+  }
+  ~Buffer() { free(ptr); }
+  ssize_t pack(void** out) override {
+    if (out) {
+      *out = malloc(n);
+      assert(*out);
+      memcpy(*out, ptr, n);
+    }
+    return n;
+  }
+  void unpack(void* in, ssize_t count) override {
+    assert(count == (ssize_t)n);
+    if (!ptr) {
+      ptr = (char*)malloc(n);
+      assert(ptr);
+    }
+    memcpy(ptr, in, count);
+  }
+  bool packsByRange() override { return chunked; }
+  void packRange(void* out, size_t offset, size_t count) override {
+    memcpy(out, ptr + offset, count);
+  }
+  void unpackRange(const void* in, size_t offset, size_t count) override {
+    if (!ptr) {
+      ptr = (char*)malloc(n);
+      assert(ptr);
+    }
+    memcpy(ptr + offset, in, count);
+  }
+  void deallocate() override {
+    free(ptr);
+    ptr = NULL;
+  }
+  size_t size() override { return n; }
+  int64_t& counter() { return *(int64_t*)ptr; }
+
+ public:
+  const size_t n;
+  char* ptr;
+  const bool chunked;
+};
+
+class IncrementTask : public Task {
+ private:
+  Buffer& b;
+
+ public:
+  IncrementTask(Buffer& b) : Task("increment"), b(b) {}
+  void call() override { b.counter()++; }
+};
+
+int main(int argc, char** argv) {
+  DECLARE_CONTEXT;
+  tracing_set_worker_index_func(toyrtWorkerId);
+
+  int provided;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_SERIALIZED, &provided);
+  const int rounds = (argc > 1 ? atoi(argv[1]) : 200);
+  const size_t maxSize = (argc > 2 ? atol(argv[2]) : 4 * 1024 * 1024);
+  const bool chunked = (argc > 3 ? atoi(argv[3]) : 1);
+
+  TaskScheduler& s = TaskScheduler::getInstance();
+  s.setMpiComm(MPI_COMM_WORLD);
+  const int rank = s.getMpiRank();
+  if (s.getMpiSize() != 2) {
+    if (rank == 0) {
+      std::cout << "Usage: mpirun -np 2 " << argv[0]
+                << " [rounds] [maxSize] [chunked]" << std::endl;
+    }
+    MPI_Finalize();
+    return 1;
+  }
+  if (rank == 0) {
+    std::cout << "# bytes, round trip (us), bandwidth (MB/s)" << std::endl;
+  }
+  int tag = 1;
+  for (size_t size = 8; size <= maxSize; size *= 4) {
+    Buffer b(size, chunked);
+    b.rank = 0;
+    b.tag = tag++;
+    for (int i = 0; i < rounds; i++) {
+      s.insertMpiTask(new IncrementTask(b), {{&b, toyRT_WRITE}}, 1);
+      s.insertMpiTask(new IncrementTask(b), {{&b, toyRT_WRITE}}, 0);
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
+    auto start = std::chrono::high_resolution_clock::now();
+    s.go(1);
+    auto stop = std::chrono::high_resolution_clock::now();
+    MpiRequestPool::getInstance().cache.eraseData(&b);
+    if (rank == 0) {
+      assert(b.counter() == 2 * rounds);
+      const double roundTrip =
+          std::chrono::duration<double>(stop - start).count() / rounds;
+      std::cout << size << " " << roundTrip * 1e6 << " "
+                << 2 * size / roundTrip / (1024 * 1024) << std::endl;
+    }
+  }
+  MPI_Finalize();
+  return 0;
+}
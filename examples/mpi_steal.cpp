@@ -0,0 +1,135 @@
+/** MPI work stealing benchmark for runtime.
+
+    All the tasks are placed on rank 0. Each one sleeps for a fixed time, to
+    emulate some work without competing for the cores (that are often
+    oversubscribed when testing), then records the rank it ran on in its own
+    block. With stealing, the other ranks take over a share of the tasks. Run
+    with any number of processes:
+
+    mpirun -np 4 ./mpi_steal [tasks] [taskTime (us)] [blockSize] [stealing]
+
+    The task costs are in microseconds, with 50 us per message and 1 GB/s.
+ */
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <mpi.h>
+
+#include "context/context.hpp"
+#include "data.hpp"
+#include "dependencies.hpp"
+#include "task.hpp"
+
+/** Array of int64_t, allocated on demand. */
+class Block : public Data {
+ public:
+  Block(size_t n) : Data(), n(std::max(n, (size_t)2)), ptr(NULL) {
+    allocate();
+  }
+  ~Block() { free(ptr); }
+  ssize_t pack(void** out) override {
+    if (out) {
+      *out = malloc(size());
+      assert(*out);
+      memcpy(*out, ptr, size());
+    }
+    return size();
+  }
+  void unpack(void* in, ssize_t count) override {
+    assert(count == (ssize_t)size());
+    allocate();
+    memcpy(ptr, in, count);
+  }
+  void deallocate() override {
+    free(ptr);
+    ptr = NULL;
+  }
+  size_t size() override { return n * sizeof(int64_t); }
+  void allocate() {
+    if (!ptr) {
+      ptr = (int64_t*)calloc(n, sizeof(int64_t));
+      assert(ptr);
+    }
+  }
+
+ public:
+  const size_t n;
+  int64_t* ptr;
+};
+
+/** Sleep, then count the run and record the rank in the block. */
+class SleepTask : public Task {
+ private:
+  Block& b;
+  int time;
+
+ public:
+  SleepTask(Block& b, int time) : Task("sleep"), b(b), time(time) {}
+  void call() override {
+    std::this_thread::sleep_for(std::chrono::microseconds(time));
+    b.ptr[0]++;
+    b.ptr[1] = TaskScheduler::getInstance().getMpiRank();
+  }
+  double cost() const override { return time; }
+};
+
+int main(int argc, char** argv) {
+  DECLARE_CONTEXT;
+  tracing_set_worker_index_func(toyrtWorkerId);
+
+  int provided;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_SERIALIZED, &provided);
+  const int tasks = (argc > 1 ? atoi(argv[1]) : 64);
+  const int taskTime = (argc > 2 ? atoi(argv[2]) : 10000);
+  const size_t blockSize = (argc > 3 ? atol(argv[3]) : 1024);
+  const bool stealing = (argc > 4 ? atoi(argv[4]) : 1);
+
+  TaskScheduler& s = TaskScheduler::getInstance();
+  s.setMpiComm(MPI_COMM_WORLD);
+  const int rank = s.getMpiRank();
+  const int size = s.getMpiSize();
+  s.stealing = stealing;
+  s.placement.messageCost = 50.;
+  s.placement.byteCost = 1e-3;
+
+  std::vector<std::unique_ptr<Block>> blocks;
+  for (int i = 0; i < tasks; i++) {
+    blocks.emplace_back(new Block(blockSize / sizeof(int64_t)));
+    blocks[i]->rank = 0;
+    blocks[i]->tag = i + 1;
+    s.insertMpiTask(new SleepTask(*blocks[i], taskTime),
+                    {{blocks[i].get(), toyRT_WRITE}}, 0);
+  }
+  MPI_Barrier(MPI_COMM_WORLD);
+  auto start = std::chrono::high_resolution_clock::now();
+  s.go(1);
+  auto stop = std::chrono::high_resolution_clock::now();
+  for (auto& b : blocks) {
+    MpiRequestPool::getInstance().cache.eraseData(b.get());
+  }
+  if (rank == 0) {
+    std::vector<int> ran(size, 0);
+    for (auto& b : blocks) {
+      assert(b->ptr[0] == 1);
+      ran[b->ptr[1]]++;
+    }
+    std::cout << "time (s) = "
+              << std::chrono::duration<double>(stop - start).count()
+              << ", ideal = " << (double)tasks * taskTime * 1e-6 / size
+              << std::endl
+              << "tasks per rank:";
+    for (int n : ran) {
+      std::cout << " " << n;
+    }
+    std::cout << std::endl;
+  }
+  MPI_Finalize();
+  return 0;
+}
@@ -0,0 +1,371 @@
+/** Out-of-core GEMM example for runtime.
+
+    C = passes x A.B on square tiled matrices, with a memory limit below the
+    size of the three matrices so that the runtime has to swap tiles to disk.
+    Each pass goes over all the tiles of A and B again. The swap
+    volume is dumped to data_written.txt and data_read.txt, see
+    tools/swap_volume.py.
+
+    The optional arguments are key=value pairs:
+    - policy=lru|nextuse: eviction policy
+    - passes=P: number of passes over A and B
+    - lookahead=L: prefetch lookahead depth
+    - backend=file|compressed|tiered|multi: swap backend
+    - pool=MB: size of the compressed in-memory pool of backend=tiered
+    - tiers=dir:MB:weight,...: storage tiers of backend=multi, MB=0 meaning
+      no limit
+    - payload=heap|mapped: tiles on the heap, or in a memory-mapped file
+      paged by the kernel (MappedData)
+    - scheduler=priority|residency: ordering of the ready tasks
+    - admission=0|1: memory-footprint-aware admission of the ready tasks
+    - zeros=F: fraction of the tiles of A and B that are zero, to make the data
+      compressible
+ */
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <mpi.h>
+
+#include "context/context.hpp"
+#include "compression.hpp"
+#include "data.hpp"
+#include "dependencies.hpp"
+#include "disk.hpp"
+#include "eviction.hpp"
+#include "mapped.hpp"
+#include "memory_manager.hpp"
+#include "scheduler.hpp"
+#include "task.hpp"
+#include "tiers.hpp"
+
+typedef double scalar_t;
+
+/** Square tile that can be swapped out. */
+class Tile {
+ public:
+  Tile(int n) : n(n) {}
+  virtual ~Tile() {}
+  /** The runtime handle of the tile. */
+  virtual Data* data() = 0;
+  /** Column-major values, only valid while the tile is in core. */
+  virtual scalar_t* values() = 0;
+  scalar_t& get(int i, int j) { return values()[i + j * n]; }
+
+ protected:
+  size_t bytes() const { return sizeof(scalar_t) * n * n; }
+
+ public:
+  const int n;
+};
+
+/** Tile on the heap, packed and written by the IO backend. */
+class HeapTile : public Data, public Tile {
+ public:
+  HeapTile(int n) : Data(), Tile(n), ptr(NULL) {
+    swappable = true;
+    ptr = (scalar_t*)calloc(n * n, sizeof(scalar_t));
+    assert(ptr);
+  }
+  ~HeapTile() { free(ptr); }
+  ssize_t pack(void** out) override {
+    if (out) {
+      assert(ptr);
+      *out = malloc(bytes());
+      assert(*out);
+      memcpy(*out, ptr, bytes());
+    }
+    return bytes();
+  }
+  void unpack(void* in, ssize_t count) override {
+    assert(count == (ssize_t)bytes());
+    if (!ptr) {
+      ptr = (scalar_t*)malloc(bytes());
+      assert(ptr);
+    }
+    memcpy(ptr, in, count);
+  }
+  void deallocate() override {
+    free(ptr);
+    ptr = NULL;
+  }
+  size_t size() override { return bytes(); }
+  Data* data() override { return this; }
+  scalar_t* values() override { return ptr; }
+
+ private:
+  scalar_t* ptr;
+};
+
+/** Tile in the memory-mapped file, paged by the kernel. */
+class MappedTile : public MappedData, public Tile {
+ public:
+  MappedTile(int n) : MappedData(sizeof(scalar_t) * n * n), Tile(n) {
+    swappable = true;
+  }
+  Data* data() override { return this; }
+  scalar_t* values() override { return (scalar_t*)payload; }
+};
+
+/** c += a.b */
+class GemmTask : public Task {
+ private:
+  Tile &c, &a, &b;
+
+ public:
+  GemmTask(Tile& c, Tile& a, Tile& b) : Task("gemm"), c(c), a(a), b(b) {}
+  void call() override {
+    const int n = c.n;
+    scalar_t* cv = c.values();
+    const scalar_t* av = a.values();
+    const scalar_t* bv = b.values();
+    for (int j = 0; j < n; j++) {
+      for (int k = 0; k < n; k++) {
+        const scalar_t b_kj = bv[k + j * n];
+        for (int i = 0; i < n; i++) {
+          cv[i + j * n] += av[i + k * n] * b_kj;
+        }
+      }
+    }
+  }
+};
+
+/** Copy a tile to a full matrix, while it is in core. */
+class GatherTask : public Task {
+ private:
+  Tile& t;
+  scalar_t* dest;
+  int ld;
+
+ public:
+  GatherTask(Tile& t, scalar_t* dest, int ld)
+      : Task("gather"), t(t), dest(dest), ld(ld) {}
+  void call() override {
+    for (int j = 0; j < t.n; j++) {
+      memcpy(dest + j * ld, t.values() + j * t.n, t.n * sizeof(scalar_t));
+    }
+  }
+};
+
+typedef std::vector<std::unique_ptr<Tile> > Tiles;
+
+static Tile* newTile(int n, bool mapped) {
+  if (mapped) {
+    return new MappedTile(n);
+  }
+  return new HeapTile(n);
+}
+
+static Tiles randomTiles(int nTiles, int tileSize, double zeros, bool mapped,
+                         std::mt19937& rgen) {
+  std::uniform_real_distribution<scalar_t> dist(0, 1);
+  Tiles tiles;
+  for (int t = 0; t < nTiles * nTiles; t++) {
+    tiles.emplace_back(newTile(tileSize, mapped));
+    if (dist(rgen) < zeros) {
+      continue;
+    }
+    for (int i = 0; i < tileSize * tileSize; i++) {
+      tiles.back()->values()[i] = dist(rgen);
+    }
+  }
+  return tiles;
+}
+
+int main(int argc, char** argv) {
+  {
+    DECLARE_CONTEXT;
+    tracing_set_worker_index_func(toyrtWorkerId);
+
+    MPI_Init(&argc, &argv);
+    if (argc < 4) {
+      std::cout << "Usage: " << argv[0]
+                << " N ntiles memoryMB [policy=lru|nextuse] [passes=1]"
+                   " [lookahead=0] [backend=file|compressed|tiered|multi]"
+                   " [pool=1] [tiers=/tmp:1:2,/tmp:0:1] [payload=heap|mapped]"
+                   " [scheduler=priority|residency]"
+                   " [admission=0] [zeros=0]"
+                << std::endl;
+      return 0;
+    }
+    const int n = atoi(argv[1]);
+    const int nTiles = atoi(argv[2]);
+    const double memoryMB = atof(argv[3]);
+    std::map<std::string, std::string> options = {{"policy", "lru"},
+                                                  {"passes", "1"},
+                                                  {"lookahead", "0"},
+                                                  {"backend", "file"},
+                                                  {"pool", "1"},
+                                                  {"tiers", "/tmp:1:2,/tmp:0:1"},
+                                                  {"payload", "heap"},
+                                                  {"scheduler", "priority"},
+                                                  {"admission", "0"},
+                                                  {"zeros", "0"}};
+    for (int i = 4; i < argc; i++) {
+      const std::string arg(argv[i]);
+      const size_t eq = arg.find('=');
+      if (eq == std::string::npos || !options.count(arg.substr(0, eq))) {
+        std::cout << "Unknown option " << arg << std::endl;
+        return 1;
+      }
+      options[arg.substr(0, eq)] = arg.substr(eq + 1);
+    }
+    const std::string policy = options["policy"];
+    const int passes = atoi(options["passes"].c_str());
+    const int lookahead = atoi(options["lookahead"].c_str());
+    const std::string backend = options["backend"];
+    const double zeros = atof(options["zeros"].c_str());
+    const double poolMB = atof(options["pool"].c_str());
+    assert(options["payload"] == "heap" || options["payload"] == "mapped");
+    const bool mapped = (options["payload"] == "mapped");
+    assert(n % nTiles == 0);
+    const int tileSize = n / nTiles;
+
+    TaskScheduler& s = TaskScheduler::getInstance();
+    s.setMpiComm(MPI_COMM_WORLD);
+    s.maxMemorySize = (size_t)(memoryMB * 1024 * 1024);
+    s.lookaheadDepth = lookahead;
+    s.admissionControl = (atoi(options["admission"].c_str()) != 0);
+    if (options["scheduler"] == "residency") {
+      s.useScheduler<ResidencyScheduler>();
+    } else {
+      assert(options["scheduler"] == "priority");
+    }
+    if (policy == "nextuse") {
+      s.setEvictionPolicy(
+          std::unique_ptr<EvictionPolicy>(new FurthestNextUsePolicy()));
+    } else {
+      assert(policy == "lru");
+    }
+    CompressingIoBackend* compressing = NULL;
+    CompressedMemoryTier* tier = NULL;
+    TieredIoBackend* multi = NULL;
+    if (backend == "compressed") {
+      compressing = new CompressingIoBackend(
+          std::unique_ptr<IoBackend>(new FileIoBackend()));
+      IoThread::getInstance().setBackend(
+          std::unique_ptr<IoBackend>(compressing));
+    } else if (backend == "tiered") {
+      tier = new CompressedMemoryTier(
+          std::unique_ptr<IoBackend>(new FileIoBackend()),
+          (size_t)(poolMB * 1024 * 1024));
+      IoThread::getInstance().setBackend(std::unique_ptr<IoBackend>(tier));
+    } else if (backend == "multi") {
+      multi = new TieredIoBackend();
+      std::stringstream specs(options["tiers"]);
+      std::string spec;
+      while (std::getline(specs, spec, ',')) {
+        const size_t c1 = spec.find(':'), c2 = spec.rfind(':');
+        assert(c1 != std::string::npos && c2 > c1);
+        const double tierMB = atof(spec.substr(c1 + 1, c2 - c1 - 1).c_str());
+        multi->addTier(spec.substr(0, c1).c_str(),
+                       (size_t)(tierMB * 1024 * 1024),
+                       atof(spec.substr(c2 + 1).c_str()));
+      }
+      IoThread::getInstance().setBackend(std::unique_ptr<IoBackend>(multi));
+    } else {
+      assert(backend == "file");
+    }
+
+    std::mt19937 rgen(42);
+    Tiles a = randomTiles(nTiles, tileSize, zeros, mapped, rgen);
+    Tiles b = randomTiles(nTiles, tileSize, zeros, mapped, rgen);
+    Tiles c;
+    for (int t = 0; t < nTiles * nTiles; t++) {
+      c.emplace_back(newTile(tileSize, mapped));
+    }
+    std::vector<scalar_t> result((size_t)n * n);
+
+    std::cout << "Matrices: 3 x " << 8. * n * n / (1024 * 1024)
+              << " MB, memory limit: " << memoryMB << " MB, policy "
+              << s.evictionPolicy->name() << std::endl;
+    // Reference result, computed before the tiles get swapped.
+    std::vector<scalar_t> reference((size_t)n * n, 0.);
+    for (int jb = 0; jb < nTiles; jb++) {
+      for (int ib = 0; ib < nTiles; ib++) {
+        for (int kb = 0; kb < nTiles; kb++) {
+          Tile& a_ik = *a[ib + kb * nTiles];
+          Tile& b_kj = *b[kb + jb * nTiles];
+          for (int j = 0; j < tileSize; j++) {
+            for (int k = 0; k < tileSize; k++) {
+              for (int i = 0; i < tileSize; i++) {
+                reference[(ib * tileSize + i) + (jb * tileSize + j) * n] +=
+                    passes * a_ik.get(i, k) * b_kj.get(k, j);
+              }
+            }
+          }
+        }
+      }
+    }
+
+    for (int j = 0; j < nTiles; j++) {
+      for (int i = 0; i < nTiles; i++) {
+        Tile& c_ij = *c[i + j * nTiles];
+        for (int pass = 0; pass < passes; pass++) {
+          for (int k = 0; k < nTiles; k++) {
+            Tile& a_ik = *a[i + k * nTiles];
+            Tile& b_kj = *b[k + j * nTiles];
+            s.insertTask(std::unique_ptr<Task>(new GemmTask(c_ij, a_ik, b_kj)),
+                         {{c_ij.data(), toyRT_WRITE},
+                          {a_ik.data(), toyRT_READ},
+                          {b_kj.data(), toyRT_READ}});
+          }
+        }
+        scalar_t* dest = &result[(i * tileSize) + (j * tileSize) * n];
+        s.insertTask(std::unique_ptr<Task>(new GatherTask(c_ij, dest, n)),
+                     {{c_ij.data(), toyRT_READ}});
+      }
+    }
+    auto start = std::chrono::high_resolution_clock::now();
+    s.go(4);  // 4 threads
+    auto stop = std::chrono::high_resolution_clock::now();
+    std::cout << "Time: " << std::chrono::duration<double>(stop - start).count()
+              << " s" << std::endl;
+    std::cout << "Swap-outs cancelled: "
+              << IoThread::getInstance().cancelledRequests()
+              << ", coalesced: " << IoThread::getInstance().coalescedRequests()
+              << ", eviction passes: "
+              << MemoryManager::getInstance().evictionPasses()
+              << ", rejected tasks: " << s.rejectedTaskCount() << std::endl;
+    if (compressing) {
+      std::cout << "Compression ratio: " << compressing->compressionRatio()
+                << ", compression: " << compressing->compressionThroughput()
+                << " MB/s, decompression: "
+                << compressing->decompressionThroughput() << " MB/s"
+                << std::endl;
+    }
+    if (tier) {
+      std::cout << "Compressed pool hits: " << tier->poolHits()
+                << ", misses: " << tier->poolMisses()
+                << ", demoted: " << tier->demotedSize() / (1024. * 1024)
+                << " MB" << std::endl;
+    }
+    if (multi) {
+      for (int t = 0; t < multi->tierCount(); t++) {
+        std::cout << "Tier " << t << ": "
+                  << multi->tierUsedSize(t) / (1024. * 1024) << " MB stored"
+                  << std::endl;
+      }
+    }
+
+    double maxError = 0.;
+    for (size_t i = 0; i < result.size(); i++) {
+      maxError = std::max(maxError, fabs(result[i] - reference[i]));
+    }
+    std::cout << "Max error: " << maxError << std::endl;
+    assert(maxError < 1e-8);
+  }
+  tracing_dump("ooc_gemm_trace.json");
+
+  return 0;
+}
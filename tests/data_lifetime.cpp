@@ -0,0 +1,88 @@
+/** Destroy the Data tracked by the eviction policy before the TaskScheduler.
+
+    After go(), the swappable data that are not used anymore are in the
+    eviction policy. Destroying them must remove them from it, and the
+    destruction of the policy at exit must not touch them.
+ */
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include <mpi.h>
+
+#include "data.hpp"
+#include "dependencies.hpp"
+#include "eviction.hpp"
+#include "task.hpp"
+
+class Block : public Data {
+ public:
+  Block() : Data(), ptr(NULL) { swappable = true; }
+  ~Block() { free(ptr); }
+  ssize_t pack(void**) override { return 0; }
+  void unpack(void*, ssize_t) override {}
+  void deallocate() override {
+    free(ptr);
+    ptr = NULL;
+  }
+  size_t size() override { return 64; }
+
+  void* ptr;
+};
+
+class WriteTask : public Task {
+ private:
+  Block& b;
+
+ public:
+  WriteTask(Block& b) : Task("write"), b(b) {}
+  void call() override {
+    if (!b.ptr) {
+      b.ptr = malloc(b.size());
+    }
+  }
+};
+
+/** Destroyed after the scheduler. */
+static Block last;
+
+static bool run(TaskScheduler& s) {
+  std::vector<std::unique_ptr<Block>> blocks;
+  for (int i = 0; i < 16; i++) {
+    blocks.emplace_back(new Block());
+    blocks[i]->rank = 0;
+    blocks[i]->tag = i + 1;
+    s.insertMpiTask(new WriteTask(*blocks[i]), {{blocks[i].get(), toyRT_WRITE}},
+                    0);
+  }
+  s.go(1);
+  std::unique_lock<std::mutex> lock(s.lruMutex);
+  if (!s.evictionPolicy->contains(blocks[0].get())) {
+    std::cout << s.evictionPolicy->name() << ": data not tracked" << std::endl;
+    return false;
+  }
+  lock.unlock();
+  blocks.clear();
+  lock.lock();
+  if (s.evictionPolicy->removeVictim()) {
+    std::cout << s.evictionPolicy->name() << ": destroyed data still tracked"
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  MPI_Init(&argc, &argv);
+  TaskScheduler& s = TaskScheduler::getInstance();
+  s.setMpiComm(MPI_COMM_WORLD);
+  bool ok = run(s);
+  s.setEvictionPolicy(
+      std::unique_ptr<EvictionPolicy>(new FurthestNextUsePolicy()));
+  ok = run(s) && ok;
+  s.setEvictionPolicy(std::unique_ptr<EvictionPolicy>(new LruEvictionPolicy()));
+  s.evictionPolicy->put(&last);
+  MPI_Finalize();
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
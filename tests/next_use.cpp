@@ -0,0 +1,59 @@
+/** Refresh the furthest-next-use keys when the next use of a data changes.
+
+    After go(), two data written once have no next use. Submitting a task that
+    reads one of them must make the other one the victim.
+ */
+#include <cstdlib>
+#include <iostream>
+
+#include <mpi.h>
+
+#include "data.hpp"
+#include "dependencies.hpp"
+#include "eviction.hpp"
+#include "task.hpp"
+
+class Block : public Data {
+ public:
+  Block() : Data() { swappable = true; }
+  ssize_t pack(void**) override { return 0; }
+  void unpack(void*, ssize_t) override {}
+  void deallocate() override {}
+  size_t size() override { return 64; }
+};
+
+class NopTask : public Task {
+ public:
+  NopTask() : Task("nop") {}
+  void call() override {}
+};
+
+int main(int argc, char** argv) {
+  MPI_Init(&argc, &argv);
+  TaskScheduler& s = TaskScheduler::getInstance();
+  s.setMpiComm(MPI_COMM_WORLD);
+  s.setEvictionPolicy(
+      std::unique_ptr<EvictionPolicy>(new FurthestNextUsePolicy()));
+  bool ok = true;
+  {
+    Block blocks[2];
+    for (int i = 0; i < 2; i++) {
+      blocks[i].rank = 0;
+      blocks[i].tag = i + 1;
+      s.insertMpiTask(new NopTask(), {{&blocks[i], toyRT_WRITE}}, 0);
+    }
+    s.go(1);
+    // Without a refresh, the tie is broken by the address.
+    Block* reused = &blocks[1];
+    s.insertMpiTask(new NopTask(), {{reused, toyRT_READ}}, 0);
+    std::unique_lock<std::mutex> lock(s.lruMutex);
+    if (s.evictionPolicy->removeVictim() != &blocks[0]) {
+      std::cout << "the data read next was chosen as victim" << std::endl;
+      ok = false;
+    }
+    lock.unlock();
+    s.go(1);
+  }
+  MPI_Finalize();
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,134 @@
+/** Reuse a tag across go() calls with another kind of data, and let the size
+    of a data change between versions.
+
+    The sender and the receiver must agree on the way each transfer goes
+    (batched, single message or chunks) whatever was sent before with the same
+    tag. Run with 2 processes.
+ */
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <mpi.h>
+
+#include "data.hpp"
+#include "dependencies.hpp"
+#include "mpi.hpp"
+#include "task.hpp"
+
+/** Bytes all equal to a version number, packed by ranges or not. */
+class Buffer : public Data {
+ public:
+  Buffer(size_t n, bool chunked) : Data(), n(n), ptr(NULL), chunked(chunked) {
+    ptr = (char*)calloc(n, 1);
+  }
+  ~Buffer() { free(ptr); }
+  ssize_t pack(void** out) override {
+    if (out) {
+      *out = malloc(std::max(n, (size_t)1));
+      memcpy(*out, ptr, n);
+    }
+    return n;
+  }
+  void unpack(void* in, ssize_t count) override {
+    resize(count);
+    memcpy(ptr, in, count);
+  }
+  bool packsByRange() override { return chunked; }
+  void packRange(void* out, size_t offset, size_t count) override {
+    memcpy(out, ptr + offset, count);
+  }
+  void unpackRange(const void* in, size_t offset, size_t count) override {
+    if (!ptr) {
+      ptr = (char*)malloc(n);
+    }
+    memcpy(ptr + offset, in, count);
+  }
+  void deallocate() override {
+    free(ptr);
+    ptr = NULL;
+  }
+  size_t size() override { return n; }
+  void resize(size_t count) {
+    free(ptr);
+    n = count;
+    ptr = (char*)malloc(std::max(n, (size_t)1));
+  }
+  bool holds(char version) const {
+    return std::all_of(ptr, ptr + n, [version](char c) { return c == version; });
+  }
+
+  size_t n;
+  char* ptr;
+  const bool chunked;
+};
+
+static int errors = 0;
+
+/** Check the previous version, then write a new one of \a n bytes. */
+class WriteTask : public Task {
+ private:
+  Buffer& b;
+  char version;
+  size_t n;
+
+ public:
+  WriteTask(Buffer& b, char version, size_t n)
+      : Task("write"), b(b), version(version), n(n) {}
+  void call() override {
+    if (!b.holds(version - 1)) {
+      errors++;
+    }
+    if (n != b.n) {
+      b.resize(n);
+    }
+    memset(b.ptr, version, n);
+  }
+};
+
+/** Versions 1..sizes.size() of a data owned by rank 0, written alternately
+    by rank 1 and rank 0. */
+static void run(TaskScheduler& s, Buffer& b, const std::vector<size_t>& sizes) {
+  b.rank = 0;
+  b.tag = 1;
+  for (size_t i = 0; i < sizes.size(); i++) {
+    s.insertMpiTask(new WriteTask(b, (char)(i + 1), sizes[i]),
+                    {{&b, toyRT_WRITE}}, (i % 2 == 0) ? 1 : 0);
+  }
+  s.go(1);
+  MpiRequestPool::getInstance().cache.eraseData(&b);
+}
+
+int main(int argc, char** argv) {
+  int provided;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_SERIALIZED, &provided);
+  TaskScheduler& s = TaskScheduler::getInstance();
+  s.setMpiComm(MPI_COMM_WORLD);
+  const size_t big = 4 * 1024 * 1024;
+  {
+    Buffer b(big, false);
+    run(s, b, {big, big});
+  }
+  {
+    Buffer b(big, true);
+    run(s, b, {big, big});
+  }
+  {
+    Buffer b(big, false);
+    run(s, b, {big, big});
+  }
+  {
+    // Small versions first, then large ones on the same pairs.
+    Buffer b(8, false);
+    run(s, b, {8, 8, 8, 8, big, big, 8, 8});
+  }
+  int total = 0;
+  MPI_Allreduce(&errors, &total, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+  if (total && (s.getMpiRank() == 0)) {
+    std::cout << total << " wrong versions received" << std::endl;
+  }
+  MPI_Finalize();
+  return total ? EXIT_FAILURE : EXIT_SUCCESS;
+}
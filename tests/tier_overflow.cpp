@@ -0,0 +1,61 @@
+/** Store data on TieredIoBackend when every tier is full.
+
+    The data that cannot be placed on any bounded tier, even after demoting
+    colder data, must go to the slowest tier past its capacity, and all the
+    data must read back unchanged, striped or not.
+ */
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "data.hpp"
+#include "tiers.hpp"
+
+class Block : public Data {
+ public:
+  Block() : Data() {}
+  ssize_t pack(void**) override { return 0; }
+  void unpack(void*, ssize_t) override {}
+  void deallocate() override {}
+  size_t size() override { return 0; }
+};
+
+int main() {
+  bool ok = true;
+  {
+    TieredIoBackend backend;
+    backend.stripeThreshold = 2048;
+    backend.addTier(".", 2048, 2);
+    backend.addTier(".", 2048, 1);
+    // Striped, then too large for any tier, then no room left anywhere.
+    const size_t sizes[] = {3000, 3000, 1000};
+    const int n = sizeof(sizes) / sizeof(sizes[0]);
+    Block blocks[n];
+    std::vector<std::vector<char> > contents(n);
+    for (int i = 0; i < n; i++) {
+      contents[i].resize(sizes[i]);
+      for (size_t j = 0; j < sizes[i]; j++) {
+        contents[i][j] = (char)(i * 31 + j);
+      }
+      backend.writeBuffer(&blocks[i], contents[i].data(), sizes[i]);
+    }
+    if (backend.tierUsedSize(1) <= 2048) {
+      std::cout << "the slowest tier did not take the overflow" << std::endl;
+      ok = false;
+    }
+    for (int i = 0; i < n; i++) {
+      void* ptr = NULL;
+      size_t size = backend.readBuffer(&blocks[i], &ptr);
+      if ((size != sizes[i]) || memcmp(ptr, contents[i].data(), size)) {
+        std::cout << "data " << i << " read back wrong" << std::endl;
+        ok = false;
+      }
+      free(ptr);
+    }
+    for (int i = 0; i < n; i++) {
+      backend.deleteData(&blocks[i]);
+    }
+  }
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
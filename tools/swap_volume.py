@@ -0,0 +1,38 @@
+#!/usr/bin/python
+"""Summarize the OOC swap volume of toyRT runs.
+
+The runtime dumps the size of every swap-out to data_written.txt and of every
+swap-in to data_read.txt, as "timestamp_in_ns size_in_bytes" lines. Run each
+configuration in its own directory, then compare them with:
+
+  swap_volume.py run_lru/ run_nextuse/
+"""
+import os
+import sys
+
+
+def totalBytes(filename):
+    """Return the sum of the records of a TimedDataRecorder<size_t> file."""
+    total = 0
+    with open(filename, "r") as f:
+        for line in f:
+            fields = line.split()
+            if len(fields) == 2:
+                total += int(float(fields[1]))
+    return total
+
+
+def swapVolume(directory):
+    """Return (written, read) in bytes for the run in directory."""
+    return (totalBytes(os.path.join(directory, "data_written.txt")),
+            totalBytes(os.path.join(directory, "data_read.txt")))
+
+
+if __name__ == "__main__":
+    directories = sys.argv[1:] if len(sys.argv) > 1 else ["."]
+    mb = 1024. * 1024.
+    print("%-30s %12s %12s %12s" % ("run", "written MB", "read MB", "total MB"))
+    for directory in directories:
+        written, read = swapVolume(directory)
+        print("%-30s %12.2f %12.2f %12.2f" % (directory, written / mb,
+                                              read / mb, (written + read) / mb))
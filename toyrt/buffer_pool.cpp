@@ -0,0 +1,88 @@
+#include "buffer_pool.hpp"
+
+#include <cassert>
+#include <cstdlib>
+
+#include "context/memory_instrumentation.hpp"
+
+BufferPool::BufferPool()
+    : cached(0),
+      capacity(64 * 1024 * 1024),
+      acquisitions(0),
+      reuses(0) {}
+
+BufferPool::~BufferPool() { trim(); }
+
+size_t BufferPool::sizeClass(size_t count) {
+  if (count <= kMinSize) {
+    return 0;
+  }
+  // count is in ]2^p, 2^(p+1)], cut into 4 steps of 2^(p-2).
+  size_t power = kMinSize;
+  size_t index = 0;
+  while (2 * power < count) {
+    power *= 2;
+    index += 4;
+  }
+  const size_t step = power / 4;
+  return index + (count - power + step - 1) / step;
+}
+
+size_t BufferPool::classSize(size_t index) {
+  if (index == 0) {
+    return kMinSize;
+  }
+  const size_t power = kMinSize << ((index - 1) / 4);
+  return power + ((index - 1) % 4 + 1) * (power / 4);
+}
+
+void* BufferPool::acquire(size_t count) {
+  const size_t index = sizeClass(count);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    acquisitions++;
+    if ((index < freeBuffers.size()) && !freeBuffers[index].empty()) {
+      void* ptr = freeBuffers[index].back();
+      freeBuffers[index].pop_back();
+      cached -= classSize(index);
+      reuses++;
+      return ptr;
+    }
+  }
+  const size_t size = classSize(index);
+  void* ptr = malloc(size);
+  assert(ptr);
+  REGISTER_ALLOC(ptr, size);
+  return ptr;
+}
+
+void BufferPool::release(void* ptr, size_t count) {
+  const size_t index = sizeClass(count);
+  const size_t size = classSize(index);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (cached + size <= capacity) {
+      if (freeBuffers.size() <= index) {
+        freeBuffers.resize(index + 1);
+      }
+      freeBuffers[index].push_back(ptr);
+      cached += size;
+      return;
+    }
+  }
+  REGISTER_FREE(ptr, size);
+  free(ptr);
+}
+
+void BufferPool::trim() {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (size_t index = 0; index < freeBuffers.size(); index++) {
+    const size_t size = classSize(index);
+    for (void* ptr : freeBuffers[index]) {
+      REGISTER_FREE(ptr, size);
+      free(ptr);
+    }
+    freeBuffers[index].clear();
+  }
+  cached = 0;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+/** Pool of the staging buffers of the MPI transfers.
+
+    The buffers are handed out by size classes, four per power of two, so a
+    buffer is at most 25% larger than requested. A released buffer is kept
+    for the next request of its class, as long as the free buffers total at
+    most \a capacity bytes, and freed otherwise. This saves the page faults
+    and the mmap()/munmap() calls of the large allocations, and the zeroing
+    of calloc(), on every transfer.
+
+    The pool is thread safe: MpiRequestPool uses it from the MPI thread, and
+    from the workers that post their receives themselves.
+*/
+class BufferPool {
+ private:
+  /** Smallest size class, in bytes */
+  static const size_t kMinSize = 64;
+  /** Free buffers, by size class */
+  std::vector<std::vector<void*> > freeBuffers;
+  /** Total size of \a freeBuffers, in bytes */
+  size_t cached;
+  /** Locks \a freeBuffers, \a cached and the counters */
+  std::mutex mutex;
+
+ public:
+  /** Largest total size of the free buffers kept, in bytes */
+  size_t capacity;
+  /** Number of acquire() calls, and of the ones served by a free buffer */
+  size_t acquisitions;
+  size_t reuses;
+
+ public:
+  BufferPool();
+  ~BufferPool();
+  BufferPool(const BufferPool&) = delete;
+  BufferPool& operator=(const BufferPool&) = delete;
+  /** Get a buffer of at least \a count bytes, possibly 0. */
+  void* acquire(size_t count);
+  /** Give back a buffer from acquire(), with the same \a count. */
+  void release(void* ptr, size_t count);
+  /** Free all the free buffers. */
+  void trim();
+  /** Total size of the free buffers, in bytes. */
+  size_t cachedBytes() const { return cached; }
+  /** Fraction of the acquisitions served by a free buffer. */
+  double hitRate() const {
+    return (acquisitions ? (double)reuses / acquisitions : 0.);
+  }
+
+ private:
+  /** Size class of \a count bytes */
+  static size_t sizeClass(size_t count);
+  /** Size of the buffers of a class, in bytes */
+  static size_t classSize(size_t index);
+};
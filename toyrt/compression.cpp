@@ -0,0 +1,315 @@
+#include "compression.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+namespace compression {
+namespace {
+const uint32_t kMagic = 0x5a595254;  // "TRYZ"
+const uint32_t kFlagLz = 1;
+const uint32_t kFlagShuffled = 2;
+// Maximum log2 of the number of entries of the match finder hash table.
+const int kMaxHashLog = 16;
+const size_t kMinMatch = 4;
+// Same end of block rules as LZ4: the last bytes are always literals, so that
+// the decoder never has to check for a match at the very end.
+const size_t kLastLiterals = 5;
+const size_t kMatchFindLimit = 12;
+
+struct FrameHeader {
+  uint32_t magic;
+  uint32_t flags;  // kFlag* | (elementSize << 8)
+  uint64_t rawSize;
+};
+static_assert(sizeof(FrameHeader) == kHeaderSize, "Bad frame header size");
+
+inline uint32_t read32(const uint8_t* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint32_t hash(uint32_t v, int hashLog) {
+  return (v * 2654435761u) >> (32 - hashLog);
+}
+
+inline uint8_t* writeLength(uint8_t* op, size_t len) {
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = (uint8_t)len;
+  return op;
+}
+
+inline size_t readLength(const uint8_t*& ip, const uint8_t* end) {
+  size_t len = 0;
+  uint8_t b;
+  do {
+    assert(ip < end);
+    b = *ip++;
+    len += b;
+  } while (b == 255);
+  return len;
+}
+
+uint8_t* writeSequence(uint8_t* op, const uint8_t* literals, size_t litLen,
+                       size_t offset, size_t matchLen) {
+  uint8_t* token = op++;
+  *token = (uint8_t)(std::min(litLen, (size_t)15) << 4);
+  if (litLen >= 15) {
+    op = writeLength(op, litLen - 15);
+  }
+  memcpy(op, literals, litLen);
+  op += litLen;
+  if (offset) {
+    *token |= (uint8_t)std::min(matchLen, (size_t)15);
+    *op++ = (uint8_t)(offset & 0xff);
+    *op++ = (uint8_t)(offset >> 8);
+    if (matchLen >= 15) {
+      op = writeLength(op, matchLen - 15);
+    }
+  }
+  return op;
+}
+}  // namespace
+
+void shuffle(const void* in, void* out, size_t size, size_t elementSize) {
+  const uint8_t* src = (const uint8_t*)in;
+  uint8_t* dst = (uint8_t*)out;
+  const size_t count = size / elementSize;
+  for (size_t b = 0; b < elementSize; b++) {
+    for (size_t i = 0; i < count; i++) {
+      dst[b * count + i] = src[i * elementSize + b];
+    }
+  }
+  memcpy(dst + count * elementSize, src + count * elementSize,
+         size - count * elementSize);
+}
+
+void unshuffle(const void* in, void* out, size_t size, size_t elementSize) {
+  const uint8_t* src = (const uint8_t*)in;
+  uint8_t* dst = (uint8_t*)out;
+  const size_t count = size / elementSize;
+  for (size_t b = 0; b < elementSize; b++) {
+    for (size_t i = 0; i < count; i++) {
+      dst[i * elementSize + b] = src[b * count + i];
+    }
+  }
+  memcpy(dst + count * elementSize, src + count * elementSize,
+         size - count * elementSize);
+}
+
+size_t lzBound(size_t size) { return size + size / 255 + 16; }
+
+size_t lzCompress(const void* in, size_t size, void* out) {
+  // Positions are stored on 32 bits in the hash table.
+  assert(size < ((size_t)1 << 32));
+  const uint8_t* const src = (const uint8_t*)in;
+  const uint8_t* const end = src + size;
+  const uint8_t* ip = src;
+  const uint8_t* anchor = src;
+  uint8_t* op = (uint8_t*)out;
+
+  if (size >= kMatchFindLimit) {
+    // Small inputs get a smaller table, which is cheaper to clear.
+    int hashLog = 8;
+    while ((hashLog < kMaxHashLog) && (((size_t)1 << (hashLog + 2)) < size)) {
+      hashLog++;
+    }
+    std::vector<uint32_t> table((size_t)1 << hashLog, 0);
+    const uint8_t* const matchLimit = end - kLastLiterals;
+    const uint8_t* const ipLimit = end - kMatchFindLimit;
+    // Skip faster and faster over incompressible data.
+    unsigned misses = 0;
+    while (ip <= ipLimit) {
+      const uint32_t seq = read32(ip);
+      const uint32_t h = hash(seq, hashLog);
+      const uint8_t* ref = src + table[h];
+      table[h] = (uint32_t)(ip - src);
+      if ((ref >= ip) || (ip - ref > 0xffff) || (read32(ref) != seq)) {
+        misses++;
+        ip += 1 + (misses >> 6);
+        continue;
+      }
+      misses = 0;
+      while ((ip > anchor) && (ref > src) && (ip[-1] == ref[-1])) {
+        ip--;
+        ref--;
+      }
+      const uint8_t* mp = ip + kMinMatch;
+      const uint8_t* mr = ref + kMinMatch;
+      while ((mp < matchLimit) && (*mp == *mr)) {
+        mp++;
+        mr++;
+      }
+      op = writeSequence(op, anchor, ip - anchor, ip - ref,
+                         mp - ip - kMinMatch);
+      ip = mp;
+      anchor = ip;
+    }
+  }
+  op = writeSequence(op, anchor, end - anchor, 0, 0);
+  return op - (uint8_t*)out;
+}
+
+void lzDecompress(const void* in, size_t size, void* out, size_t outSize) {
+  const uint8_t* ip = (const uint8_t*)in;
+  const uint8_t* const end = ip + size;
+  uint8_t* const dst = (uint8_t*)out;
+  uint8_t* op = dst;
+  uint8_t* const oend = dst + outSize;
+
+  while (ip < end) {
+    const uint8_t token = *ip++;
+    size_t litLen = token >> 4;
+    if (litLen == 15) {
+      litLen += readLength(ip, end);
+    }
+    assert((ip + litLen <= end) && (op + litLen <= oend));
+    memcpy(op, ip, litLen);
+    ip += litLen;
+    op += litLen;
+    if (ip >= end) {
+      // Last sequence, without match.
+      break;
+    }
+    assert(ip + 2 <= end);
+    const size_t offset = ip[0] | ((size_t)ip[1] << 8);
+    ip += 2;
+    assert(offset && (offset <= (size_t)(op - dst)));
+    size_t matchLen = token & 15;
+    if (matchLen == 15) {
+      matchLen += readLength(ip, end);
+    }
+    matchLen += kMinMatch;
+    assert(op + matchLen <= oend);
+    // The match may overlap the output: copy by chunks of growing size, as
+    // the data after ref are periodic.
+    const uint8_t* ref = op - offset;
+    while (matchLen > 0) {
+      const size_t n = std::min(matchLen, (size_t)(op - ref));
+      memcpy(op, ref, n);
+      op += n;
+      matchLen -= n;
+    }
+  }
+  assert(op == oend);
+}
+
+size_t compress(const void* in, size_t size, size_t elementSize, void** out) {
+  assert(elementSize > 0 && elementSize < (1 << 24));
+  uint8_t* frame = (uint8_t*)malloc(kHeaderSize + lzBound(size));
+  assert(frame);
+  FrameHeader header;
+  header.magic = kMagic;
+  header.flags = kFlagLz;
+  header.rawSize = size;
+
+  const void* src = in;
+  std::vector<uint8_t> shuffled;
+  if (elementSize > 1 && size >= elementSize) {
+    shuffled.resize(size);
+    shuffle(in, shuffled.data(), size, elementSize);
+    src = shuffled.data();
+    header.flags |= kFlagShuffled | ((uint32_t)elementSize << 8);
+  }
+  size_t compressedSize = lzCompress(src, size, frame + kHeaderSize);
+  if (compressedSize >= size) {
+    // Not worth it, store the raw data.
+    header.flags = 0;
+    memcpy(frame + kHeaderSize, in, size);
+    compressedSize = size;
+  }
+  memcpy(frame, &header, kHeaderSize);
+  *out = frame;
+  return kHeaderSize + compressedSize;
+}
+
+size_t decompress(const void* in, size_t size, void** out) {
+  assert(size >= kHeaderSize);
+  FrameHeader header;
+  memcpy(&header, in, kHeaderSize);
+  assert(header.magic == kMagic);
+  const uint8_t* payload = (const uint8_t*)in + kHeaderSize;
+  const size_t payloadSize = size - kHeaderSize;
+  const size_t rawSize = header.rawSize;
+  *out = malloc(rawSize);
+  assert(*out || !rawSize);
+
+  if (!(header.flags & kFlagLz)) {
+    assert(payloadSize == rawSize);
+    memcpy(*out, payload, rawSize);
+  } else if (!(header.flags & kFlagShuffled)) {
+    lzDecompress(payload, payloadSize, *out, rawSize);
+  } else {
+    std::vector<uint8_t> shuffled(rawSize);
+    lzDecompress(payload, payloadSize, shuffled.data(), rawSize);
+    unshuffle(shuffled.data(), *out, rawSize, header.flags >> 8);
+  }
+  return rawSize;
+}
+}  // namespace compression
+
+CompressingIoBackend::CompressingIoBackend(std::unique_ptr<IoBackend> backend,
+                                           size_t elementSize)
+    : backend(std::move(backend)),
+      elementSize(elementSize),
+      rawBytes(0),
+      compressedBytes(0),
+      compressNanos(0),
+      decompressNanos(0),
+      decompressedBytes(0) {
+  assert(this->backend);
+}
+
+CompressingIoBackend::~CompressingIoBackend() {
+  ratioRecorder.toFile("compression.txt");
+}
+
+void CompressingIoBackend::writeBuffer(Data* d, const void* ptr, size_t size) {
+  void* frame;
+  auto start = std::chrono::high_resolution_clock::now();
+  size_t frameSize = compression::compress(ptr, size, elementSize, &frame);
+  auto stop = std::chrono::high_resolution_clock::now();
+  compressNanos +=
+      std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start)
+          .count();
+  rawBytes += size;
+  compressedBytes += frameSize;
+  ratioRecorder.recordSynchronized(std::make_pair(size, frameSize));
+  backend->writeBuffer(d, frame, frameSize);
+  free(frame);
+}
+
+size_t CompressingIoBackend::readBuffer(Data* d, void** ptr) {
+  void* frame = NULL;
+  size_t frameSize = backend->readBuffer(d, &frame);
+  auto start = std::chrono::high_resolution_clock::now();
+  size_t size = compression::decompress(frame, frameSize, ptr);
+  auto stop = std::chrono::high_resolution_clock::now();
+  free(frame);
+  decompressNanos +=
+      std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start)
+          .count();
+  decompressedBytes += size;
+  return size;
+}
+
+double CompressingIoBackend::compressionRatio() const {
+  return compressedBytes ? (double)rawBytes / compressedBytes : 1.;
+}
+
+double CompressingIoBackend::compressionThroughput() const {
+  return compressNanos ? (rawBytes * 1e9 / compressNanos) / (1024 * 1024) : 0.;
+}
+
+double CompressingIoBackend::decompressionThroughput() const {
+  return decompressNanos
+             ? (decompressedBytes * 1e9 / decompressNanos) / (1024 * 1024)
+             : 0.;
+}
@@ -0,0 +1,108 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "context/data_recorder.hpp"
+#include "disk.hpp"
+
+/** Dependency-free compression of the swapped data.
+
+    The codec is a byte-oriented LZ77 in the spirit of LZ4 (greedy parsing, 64
+    kB window, no entropy coding), which is fast enough to run on the IO thread.
+    An optional byte-shuffle filter groups the i-th bytes of all the elements
+    together first, so that the exponents and high mantissa bytes of floating
+    point values form long runs.
+ */
+namespace compression {
+/** Transpose the bytes of \a size / \a elementSize elements.
+
+    The trailing bytes that don't make a full element are copied as is.
+
+    @param in input buffer
+    @param out output buffer, of the same size. Must not overlap \a in
+    @param size buffer size in bytes
+    @param elementSize element size in bytes
+ */
+void shuffle(const void* in, void* out, size_t size, size_t elementSize);
+/** Inverse of \a shuffle(). */
+void unshuffle(const void* in, void* out, size_t size, size_t elementSize);
+/** Worst case size of the output of \a lzCompress(). */
+size_t lzBound(size_t size);
+/** Compress a buffer.
+
+    @param in input buffer
+    @param size input size in bytes
+    @param out output buffer, of at least \a lzBound(size) bytes
+    @return the compressed size in bytes
+ */
+size_t lzCompress(const void* in, size_t size, void* out);
+/** Decompress a buffer produced by \a lzCompress().
+
+    @param in compressed buffer
+    @param size compressed size in bytes
+    @param out output buffer
+    @param outSize exact size of the uncompressed data
+ */
+void lzDecompress(const void* in, size_t size, void* out, size_t outSize);
+/** Size of the header written by \a compress(). */
+const size_t kHeaderSize = 16;
+/** Compress a buffer into a self-describing frame.
+
+    The frame is a header (uncompressed size and filter) followed by the
+    compressed data, or by the raw data if they don't compress.
+
+    @param in input buffer
+    @param size input size in bytes
+    @param elementSize shuffle width in bytes, 1 to disable the shuffle
+    @param out set to a frame allocated with malloc()
+    @return the frame size in bytes
+ */
+size_t compress(const void* in, size_t size, size_t elementSize, void** out);
+/** Decompress a frame produced by \a compress().
+
+    @param in the frame
+    @param size frame size in bytes
+    @param out set to a buffer allocated with malloc()
+    @return the uncompressed size in bytes
+ */
+size_t decompress(const void* in, size_t size, void** out);
+}  // namespace compression
+
+/** IO backend decorator compressing the data before handing them to another
+    backend.
+
+    The compression runs on the thread calling the backend, i.e. the IO thread.
+    The compression ratio of each write is recorded in compression.txt as "raw
+    size, compressed size" pairs.
+ */
+class CompressingIoBackend : public IoBackend {
+ private:
+  std::unique_ptr<IoBackend> backend;
+  size_t elementSize;
+  TimedDataRecorder<std::pair<size_t, size_t> > ratioRecorder;
+  std::atomic<size_t> rawBytes, compressedBytes;
+  std::atomic<int64_t> compressNanos, decompressNanos;
+  std::atomic<size_t> decompressedBytes;
+
+ public:
+  /** Constructor.
+
+      @param backend the backend actually storing the data
+      @param elementSize shuffle width, sizeof(double) by default. 1 disables
+      the shuffle.
+   */
+  CompressingIoBackend(std::unique_ptr<IoBackend> backend,
+                       size_t elementSize = sizeof(double));
+  ~CompressingIoBackend();
+  void deleteData(Data* d) { backend->deleteData(d); }
+  void writeBuffer(Data* d, const void* ptr, size_t size);
+  size_t readBuffer(Data* d, void** ptr);
+  /** Total raw size / total compressed size of the written data. */
+  double compressionRatio() const;
+  /** Compression throughput, in MB/s of raw data. */
+  double compressionThroughput() const;
+  /** Decompression throughput, in MB/s of raw data. */
+  double decompressionThroughput() const;
+};
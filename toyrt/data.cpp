@@ -0,0 +1,5 @@
+#include "data.hpp"
+
+#include "dependencies.hpp"
+
+Data::~Data() { TaskScheduler::forgetData(this); }
@@ -1,5 +1,11 @@
 #pragma once
 
+#include <sys/types.h>
+#include <cassert>
+
+#include "holders.hpp"
+#include "lru.hpp"
+
 class Data {
  public:
   // Don't touch these
@@ -26,6 +32,15 @@ class Data {
    */
   bool prefetchInFlight;
 
+  /*! \brief Links used by LruEvictionPolicy.
+   */
+  LruHook<Data> lruHook;
+
+  // MPI
+  /*! \brief Ranks holding a valid copy, see MpiDataCache.
+   */
+  HolderSet holders;
+
   // You can touch these
   /*! \brief  Can the runtime offload this data to disk
    */
@@ -40,8 +55,11 @@ class Data {
         swapped(false),
         dirty(true),
         prefetchInFlight(false),
+        lruHook(),
+        holders(),
         swappable(false) {}
-  virtual ~Data() {}
+  /** Stop the tracking of the data by the TaskScheduler, if any. */
+  virtual ~Data();
   /** Put the data into a contiguous buffer.
 
       There are two ways to call this function:
@@ -61,6 +79,36 @@ class Data {
       @param count Buffer size in bytes
    */
   virtual void unpack(void* ptr, ssize_t count) = 0;
+  /** Can the data be packed and unpacked by ranges ?
+
+      If true, packRange() and unpackRange() must be implemented, and the MPI
+      transfers of the data are pipelined by chunks instead of going through a
+      buffer holding the whole packed data.
+   */
+  virtual bool packsByRange() { return false; }
+  /** Copy a range of the packed data into a buffer.
+
+      @param ptr Buffer of at least \a count bytes
+      @param offset Offset of the range in the packed data
+      @param count Size of the range in bytes
+   */
+  virtual void packRange(void* ptr, size_t offset, size_t count) {
+    (void)ptr, (void)offset, (void)count;
+    assert(false);
+  }
+  /** Deserialize a range of the packed data.
+
+      The ranges of a transfer may come in any order, and the data must be
+      allocated by the first one.
+
+      @param ptr Buffer containing the range
+      @param offset Offset of the range in the packed data
+      @param count Size of the range in bytes
+   */
+  virtual void unpackRange(const void* ptr, size_t offset, size_t count) {
+    (void)ptr, (void)offset, (void)count;
+    assert(false);
+  }
   /** Deallocate the data on this node.
 
       This does not destroy the data.
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cassert>
 #include <fstream>
 #include <limits>
@@ -7,6 +8,7 @@
 #include "data.hpp"
 #include "dependencies.hpp"
 #include "disk.hpp"
+#include "memory_manager.hpp"
 #include "mpi.hpp"
 
 #include <mpi.h>
@@ -36,6 +38,8 @@ class SyncTask : public Task {
   SyncTask() : Task("Sync"), d(new DummyData()) { isCallback = true; }
 };
 
+TaskScheduler* TaskScheduler::live = NULL;
+
 TaskScheduler::TaskScheduler()
     : dataAccess(),
       deps(),
@@ -51,53 +55,36 @@ TaskScheduler::TaskScheduler()
       rank_(0),
       size_(0),
       mpiComm_(MPI_COMM_NULL),
+      mpiTaskCount(0),
+      activeStealing(false),
       maxMemorySize(std::numeric_limits<size_t>::max()),
+      evictionPolicy(new LruEvictionPolicy()),
       totalTasks(0),
+      lookaheadDepth(0),
+      lookaheadMemorySize(0),
+      admissionControl(false),
+      stealing(false),
+      dataSize(0),
+      lookaheadSize(0),
+      pinnedSize(0),
+      runningTasks(0),
+      rejectedTasks(0),
       verbose_(false) {
-  // TODO: Allow choosing the scheduler.
   availableTasks.reset(new PriorityScheduler(&recorder));
+  live = this;
 }
 
-static int commCountForRank(const toyRT_DepsArray& params, int rank) {
-  MpiRequestPool& mpi = MpiRequestPool::getInstance();
-  int comms = 0;
-  for (const auto& p : params) {
-    Data* d = (Data*)p.first;
-    if ((d->rank != rank)) {
-      if (mpi.cache.isValidOnNode(d, rank)) {
-        comms += (p.second == toyRT_WRITE ? 1 : 0);
-      } else {
-        // 2 for the write back to the reference node
-        comms += (p.second == toyRT_WRITE ? 2 : 1);
-      }
-    }
-  }
-  return comms;
-}
-
-static int findExecuteeNode(const toyRT_DepsArray& params, int size) {
-  int node = ((Data*)params[0].first)->rank;
-  for (const auto& p : params) {
-    if (p.second == toyRT_WRITE) {
-      node = ((Data*)p.first)->rank;
-      break;
-    }
-  }
-  // Look for the node that requires the less number of MPI messages.
-  int minComms = commCountForRank(params, node);
-  for (int rank = 0; rank < size; rank++) {
-    int comms = commCountForRank(params, rank);
-    if (comms < minComms) {
-      minComms = comms;
-      node = rank;
-    }
+void TaskScheduler::forgetData(Data* d) {
+  if (!live) {
+    return;
   }
-  return node;
+  std::lock_guard<std::mutex> guard(live->lruMutex);
+  live->evictionPolicy->remove(d);
 }
 
 void TaskScheduler::insertMpiTask(Task* task, const toyRT_DepsArray& params,
                                   int node, Priority priority) {
-  insertMpiTask(std::unique_ptr<Task>(task), params, priority);
+  insertMpiTask(std::unique_ptr<Task>(task), params, node, priority);
 }
 
 void TaskScheduler::insertMpiTask(std::unique_ptr<Task> task,
@@ -117,9 +104,11 @@ void TaskScheduler::insertMpiTask(std::unique_ptr<Task> task,
   }
 #endif
   if (node == -1) {
-    node = findExecuteeNode(params, size_);
+    node = placement.place(params, task->cost());
   }
   assert(node != -1);
+  placement.assign(node, task->cost());
+  const int id = mpiTaskCount++;
   Data* dummy = NULL;
 
   // Before posting the recv() of the foreign deps, make sure that all the local
@@ -145,40 +134,56 @@ void TaskScheduler::insertMpiTask(std::unique_ptr<Task> task,
   // Before the task:
   // - If we are executing the task: receive the data we don't have
   // - Otherwise: Send the data we have to the relevant node'
+  // The data are sent by the owner or by a node that received a copy before,
+  // see MpiDataCache::findSource().
   for (const auto& p : params) {
     Data* d = (Data*)p.first;
     assert(d->tag != 0);
-    // If we own the data and we are not the node executing the task, we send it
-    // to this node.
-    if ((d->rank == me) && (node != me)) {
-      if (!mpi.cache.isValidOnNode(d, node)) {
-        insertTask(std::unique_ptr<Task>(new MpiSendTask(d, node)),
-                   {{d, toyRT_READ}}, priority);
-      }
+    if (mpi.cache.use(d, node)) {
+      continue;
     }
-    // Else if we don't own the data and we are the node executing the task, we
-    // recv it from the owner.
-    else if ((d->rank != me) && (node == me)) {
-      if (!mpi.cache.isValid(d)) {
-        if (dummy) {
-          insertTask(std::unique_ptr<Task>(new MpiRecvTask(d, d->rank)),
-                     {{d, toyRT_WRITE}, {dummy, toyRT_READ}}, priority);
-        } else {
-          insertTask(std::unique_ptr<Task>(new MpiRecvTask(d, d->rank)),
-                     {{d, toyRT_WRITE}}, priority);
-        }
+    const int from = mpi.cache.findSource(d);
+    if (stealing) {
+      markUsed(d, from);
+    }
+    // If we have the data and we are not the node executing the task, we send
+    // it to this node.
+    if ((from == me) && (node != me)) {
+      insertTask(std::unique_ptr<Task>(new MpiSendTask(d, node)),
+                 {{d, toyRT_READ}}, priority);
+    }
+    // Else if we are the node executing the task, we recv it.
+    else if ((from != me) && (node == me)) {
+      if (dummy) {
+        insertTask(std::unique_ptr<Task>(new MpiRecvTask(d, from)),
+                   {{d, toyRT_WRITE}, {dummy, toyRT_READ}}, priority);
+      } else {
+        insertTask(std::unique_ptr<Task>(new MpiRecvTask(d, from)),
+                   {{d, toyRT_WRITE}}, priority);
       }
     }
-    mpi.cache.sendData(d, d->rank, node);
+    mpi.cache.sendData(d, from, node);
   }
+  mpi.cache.shrink(node, params);
   // Avoid cluttering the dataAccess hash table.
   //  if (dummy) {
   //    unregisterData(dummy);
   //    delete dummy;
   //  }
+  if (stealing) {
+    for (const auto& p : params) {
+      markUsed((Data*)p.first, node);
+    }
+    task->stealId = id;
+  }
   // We execute it.
   if (node == me) {
     insertTask(std::move(task), params, priority);
+  } else if (stealing) {
+    // Kept in case we steal it.
+    task->params = params;
+    task->doPostExecution = false;
+    remoteTasks[id] = std::move(task);
   }
   // After the task:
   // - If we are executing: send the data we wrote to & that we don't own back
@@ -197,6 +202,9 @@ void TaskScheduler::insertMpiTask(std::unique_ptr<Task> task,
       insertTask(std::unique_ptr<Task>(new MpiSendTask(d, d->rank)),
                  {{d, toyRT_READ}}, priority);
     }
+    if (stealing) {
+      markUsed(d, d->rank);
+    }
     mpi.cache.sendData(d, node, d->rank);
     mpi.cache.invalidateData(d, node);
   }
@@ -212,6 +220,10 @@ void TaskScheduler::getDataOnNode(Data* d, int node) {
   // TODO: Integrate this with the MPI Communication cache, to note that the
   // data was received and to avoid useless comms.
   if (size_ == 1) return;
+  if (stealing) {
+    markUsed(d, node);
+    markUsed(d, d->rank);
+  }
   if (node == rank_) {
     if (d->rank != rank_) {
       insertTask(std::unique_ptr<Task>(new MpiRecvTask(d, d->rank)),
@@ -223,6 +235,67 @@ void TaskScheduler::getDataOnNode(Data* d, int node) {
   }
 }
 
+void TaskScheduler::markUsed(Data* d, int node) {
+  HolderSet& used = usedOnNode[d];
+  if (!used.contains(node)) {
+    used.insert(node, 0);
+  }
+}
+
+bool TaskScheduler::canSteal(Task* t, int rank) {
+  MpiDataCache& cache = MpiRequestPool::getInstance().cache;
+  for (const auto& p : t->params) {
+    Data* d = (Data*)p.first;
+    auto it = usedOnNode.find(d);
+    if (((it != usedOnNode.end()) && it->second.contains(rank)) ||
+        cache.isValidOnNode(d, rank)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+Task* TaskScheduler::stealReadyTask(int thief, int& id) {
+  if (!activeStealing) {
+    return NULL;
+  }
+  TaskPtr task = NULL;
+  // Only the tasks whose data are in core are given, as they are packed
+  // right away.
+  auto accept = [this, thief](Task* t, double ahead) {
+    return (t->stealId >= 0) && t->pinned && t->isReady() &&
+           (placement.offloadCost(t->params) < ahead / nbWorkers) &&
+           canSteal(t, thief);
+  };
+  if (!availableTasks->steal(task, accept)) {
+    return NULL;
+  }
+  id = task->stealId;
+  return task;
+}
+
+Task* TaskScheduler::stolenTask(int id) {
+  auto it = remoteTasks.find(id);
+  assert(it != remoteTasks.end());
+  Task* t = it->second.get();
+  // The data may have been left in the eviction policy by a previous go().
+  std::lock_guard<std::mutex> guard(lruMutex);
+  for (const auto& p : t->params) {
+    evictionPolicy->remove((Data*)p.first);
+  }
+  return t;
+}
+
+void TaskScheduler::stealingDone() {
+  {
+    std::lock_guard<std::mutex> guard(postTaskExecutionMutex);
+    assert(tasksLeft == 1);
+    tasksLeft--;
+    stopAllWorkers();
+  }
+  notifyProgress();
+}
+
 void TaskScheduler::insertTask(Task* task, const toyRT_DepsArray& params,
                                Priority priority) {
   insertTask(std::unique_ptr<Task>(task), params, priority);
@@ -237,7 +310,7 @@ void TaskScheduler::insertTask(std::unique_ptr<Task> task,
   assert(succ.size() == tasks.size());
   Task* task_ptr = task.get();
   tasks.push_back(std::move(task));
-  succ.push_back((TaskSuccessors){0, std::deque<int>()});
+  succ.push_back((TaskSuccessors){0, std::deque<int>(), 0});
 
   // To avoid duplicate dependencies
   std::set<std::pair<int, int> > localDeps;
@@ -248,6 +321,14 @@ void TaskScheduler::insertTask(std::unique_ptr<Task> task,
     toyRT_AccessMode mode = p.second;
     assert(param);
     auto& access = dataAccess[param];
+    if (access.pending.empty()) {
+      // The data had no next use, it has one now.
+      access.pending.push_back(task_ptr->index);
+      std::lock_guard<std::mutex> guard(lruMutex);
+      evictionPolicy->refresh(param);
+    } else if (access.pending.back() != task_ptr->index) {
+      access.pending.push_back(task_ptr->index);
+    }
 
     if (param->oldSize == 0) {
       param->oldSize = param->size();
@@ -282,9 +363,12 @@ void TaskScheduler::insertTask(std::unique_ptr<Task> task,
   }
   for (auto& dep : localDeps) {
     if (dep.first !=
-        dep.second)  // Avoid to have a task depend on itself (may
-                     // occur with duplicate dependencies in params)
+        dep.second) {  // Avoid to have a task depend on itself (may
+                       // occur with duplicate dependencies in params)
       deps.push_back(dep);
+      succ[task_ptr->index].depth =
+          std::max(succ[task_ptr->index].depth, succ[dep.first].depth + 1);
+    }
   }
 }
 
@@ -321,12 +405,21 @@ void TaskScheduler::prepare() {
     succ[dep.second].count++;
   }
 
+  std::vector<Task*> ready;
   for (int i = 0; i < (int)succ.size(); i++) {
     if (succ[i].count == 0) {
-      startPrefetch(tasks[i].get());
+      if (admissionControl) {
+        pinIfFits(tasks[i].get(), false);
+      } else {
+        startPrefetch(tasks[i].get());
+      }
       availableTasks->push(tasks[i].get());
+      ready.push_back(tasks[i].get());
     }
   }
+  for (Task* t : ready) {
+    lookaheadPrefetch(t);
+  }
   tasksLeft = succ.size();
   // For the notifications
   if (percentageFrequency > 0.) {
@@ -334,6 +427,14 @@ void TaskScheduler::prepare() {
   }
   // The dependencies are no longer needed.
   deps.clear();
+  // Drop the tasks we can't steal.
+  for (auto it = remoteTasks.begin(); it != remoteTasks.end();) {
+    if (canSteal(it->second.get(), rank_)) {
+      ++it;
+    } else {
+      it = remoteTasks.erase(it);
+    }
+  }
 }
 
 void TaskScheduler::stopAllWorkers() {
@@ -359,6 +460,8 @@ std::string TaskScheduler::getLocalization() const {
     convert << "IO]";
   else if (i == -3)
     convert << "master]";
+  else if (i == -4)
+    convert << "memory]";
   else
     convert << i << "]";
   return convert.str();
@@ -373,47 +476,177 @@ void TaskScheduler::postTaskExecution(Task* task) {
 }
 
 void TaskScheduler::startPrefetch(Task* t) {
+  t->pinned = true;
   if (t->noPrefetch) return;
   std::lock_guard<std::mutex> guard(lruMutex);
+  if (t->prefetched) {
+    // Already pinned by lookaheadPrefetch(), the data now belong to a ready
+    // task.
+    lookaheadSize -= t->lookaheadSize;
+    return;
+  }
+  pinTaskData(t);
+}
+
+size_t TaskScheduler::pinTaskData(Task* t) {
+  size_t pinned = 0;
   for (const auto& p : t->params) {
     Data* d = (Data*)p.first;
-    d->refCount++;
-    lru.remove(d);
+    if (d->refCount++ == 0) {
+      pinned += d->oldSize;
+      if (admissionControl) {
+        pinnedSize += d->oldSize;
+      }
+    }
+    evictionPolicy->remove(d);
     if ((!d->prefetchInFlight) && d->swapped) {
       d->prefetchInFlight = true;
-      IoThread::getInstance().pushPrefetch(d);
+      // false if the swap-out was cancelled, in which case nothing is read.
+      bool read = IoThread::getInstance().pushPrefetch(d);
       dataSize += d->oldSize;
-      readDataRecorder.record(d->oldSize);
+      readDataRecorder.record(read ? d->oldSize : 0);
+    }
+  }
+  return pinned;
+}
+
+void TaskScheduler::lookaheadPrefetch(Task* ready) {
+  if (lookaheadDepth <= 0) return;
+  const size_t budget =
+      (lookaheadMemorySize == 0 ? maxMemorySize / 4
+                                : std::min(lookaheadMemorySize, maxMemorySize));
+  std::lock_guard<std::mutex> guard(lruMutex);
+  // Breadth-first walk, to prefetch for the closest tasks first.
+  std::deque<std::pair<int, int> > toVisit;  // (task index, level)
+  std::set<int> visited;
+  for (int s : succ[ready->index].successors) {
+    toVisit.push_back(std::make_pair(s, 1));
+  }
+  while (!toVisit.empty() && (lookaheadSize < budget)) {
+    const int index = toVisit.front().first;
+    const int level = toVisit.front().second;
+    toVisit.pop_front();
+    if (!visited.insert(index).second) continue;
+    Task* t = tasks[index].get();
+    // Tasks without predecessors left already went through startPrefetch().
+    if (!t || (succ[index].count == 0)) continue;
+    if (!t->prefetched && !t->noPrefetch) {
+      size_t cost = 0;
+      for (const auto& p : t->params) {
+        Data* d = (Data*)p.first;
+        cost += (d->refCount == 0 ? d->oldSize : 0);
+      }
+      if (lookaheadSize + cost <= budget) {
+        t->prefetched = true;
+        t->lookaheadSize = pinTaskData(t);
+        lookaheadSize += t->lookaheadSize;
+      }
+    }
+    if (level < lookaheadDepth) {
+      for (int s : succ[index].successors) {
+        toVisit.push_back(std::make_pair(s, level + 1));
+      }
+    }
+  }
+}
+
+bool TaskScheduler::pinIfFits(Task* t, bool force) {
+  if (t->pinned) {
+    return true;
+  }
+  if (!force && !t->noPrefetch) {
+    // Size of the data that would get pinned
+    size_t cost = 0;
+    std::set<Data*> seen;
+    for (const auto& p : t->params) {
+      Data* d = (Data*)p.first;
+      if ((d->refCount == 0) && seen.insert(d).second) {
+        cost += d->oldSize;
+      }
+    }
+    const size_t pinned = std::min((size_t)pinnedSize, maxMemorySize);
+    if (cost > maxMemorySize - pinned) {
+      return false;
     }
   }
+  startPrefetch(t);
+  return true;
 }
 
-void TaskScheduler::evict() {
+bool TaskScheduler::admitTask(Task* t, size_t& scratch) {
+  scratch = 0;
+  if (!admissionControl) {
+    return true;
+  }
+  {
+    std::lock_guard<std::mutex> guard(postTaskExecutionMutex);
+    scratch = t->scratchSize();
+    const size_t pinned = std::min((size_t)pinnedSize, maxMemorySize);
+    // Running a task whose data are in core doesn't make anything else swap.
+    const bool resident = t->pinned || ((scratch == 0) && t->isReady());
+    const bool force = (runningTasks == 0) || (scratch == 0 && resident);
+    if ((!force && (scratch > maxMemorySize - pinned)) ||
+        !pinIfFits(t, force || resident)) {
+      rejectedTasks++;
+      return false;
+    }
+    pinnedSize += scratch;
+    runningTasks++;
+  }
+  MemoryManager::getInstance().notify();
+  return true;
+}
+
+void TaskScheduler::evict(size_t target) {
   // Quick return to avoid taking the mutex on the LRU if it is not required.
-  if (dataSize <= maxMemorySize) {
+  if (dataSize <= target) {
     return;
   }
   std::lock_guard<std::mutex> guard(lruMutex);
   Data* d = NULL;
-  while ((dataSize > maxMemorySize) && (d = lru.removeOldest())) {
+  while ((dataSize > target) && (d = evictionPolicy->removeVictim())) {
     dataSize -= d->oldSize;
     d->prefetchInFlight = false;
     // Don't release the mutex. This assumes that pushSwap() is fast enough.
-    // Be careful though: this means that we are holding several mutexes here.
+    // Clean data are simply deallocated by the IO thread.
+    writtenDataRecorder.record(d->dirty ? d->oldSize : 0);
     IoThread::getInstance().pushSwap(d);
-    writtenDataRecorder.record(d->oldSize);
   }
 }
 
 void TaskScheduler::postTaskExecutionInternal(Task* task,
                                               std::vector<Task*>& callbacks) {
   std::lock_guard<std::mutex> guard(postTaskExecutionMutex);
+  // Data whose next use is now another task.
+  std::vector<Data*> nextUseChanged;
+  for (const auto& p : task->params) {
+    auto it = dataAccess.find((Data*)p.first);
+    if (it != dataAccess.end()) {
+      std::deque<int>& pending = it->second.pending;
+      auto pos = std::find(pending.begin(), pending.end(), task->index);
+      if (pos != pending.end()) {
+        if (pos == pending.begin()) {
+          nextUseChanged.push_back((Data*)p.first);
+        }
+        pending.erase(pos);
+      }
+    }
+  }
+  if (!nextUseChanged.empty()) {
+    // The data used by tasks that do not pin them (noPrefetch) may be tracked
+    // by the eviction policy, with a key naming this task.
+    std::lock_guard<std::mutex> guard(lruMutex);
+    for (Data* d : nextUseChanged) {
+      evictionPolicy->refresh(d);
+    }
+  }
   if (!task->noPrefetch) {
     for (const auto& p : task->params) {
       Data* d = (Data*)p.first;
       toyRT_AccessMode mode = p.second;
       assert(d->refCount > 0);
       assert(!d->swapped);
+      const size_t oldSize = d->oldSize;
       d->refCount--;
       if (mode == toyRT_AccessMode::toyRT_WRITE) {
         d->dirty = true;
@@ -421,18 +654,36 @@ void TaskScheduler::postTaskExecutionInternal(Task* task,
         d->oldSize = d->size();
         dataSize += d->oldSize;
       }
+      if (admissionControl) {
+        pinnedSize -= oldSize;
+        if (d->refCount > 0) {
+          pinnedSize += d->oldSize;
+        }
+      }
     }
     dataSizeRecorder.record(dataSize);
   }
 
   tasksLeft--;
+  if (activeStealing && (tasksLeft == 1)) {
+    // Only the tasks of the other ranks are left.
+    MpiRequestPool::getInstance().localTasksDone();
+  }
 
   // Decrease "count" = the number of predecessors of all the successors, and
   // push the ready tasks (count==0)
+  std::vector<Task*> ready;
   for (int successor : succ[task->index].successors) {
     if (--succ[successor].count == 0) {
       Task* s = tasks[successor].get();
-      startPrefetch(s);
+      // With admission control, the data of the tasks going to the workers
+      // may only be fetched once admitTask() lets them run.
+      if (admissionControl && !s->isCallback) {
+        pinIfFits(s, false);
+      } else {
+        startPrefetch(s);
+      }
+      ready.push_back(s);
       if (s->isCallback) {  // true only for: MpiSend, MpiRecv, Sync, Flush,
                             // Deallocate
         callbacks.push_back(s);
@@ -449,11 +700,14 @@ void TaskScheduler::postTaskExecutionInternal(Task* task,
     for (const auto& p : task->params) {
       Data* d = (Data*)p.first;
       if ((d->refCount == 0) && d->swappable) {
-        lru.put(d);
+        evictionPolicy->put(d);
       }
     }
   }
-  evict();
+  for (Task* s : ready) {
+    lookaheadPrefetch(s);
+  }
+  MemoryManager::getInstance().notify();
   tasks[task->index] = nullptr;
   if (!tasksLeft) {
     // We are processing the last task post-execution hook. This means that no
@@ -482,12 +736,21 @@ void TaskScheduler::go(int n) {
   recorder.tag("Prepare");
   prepare();
   recorder.tag("Go");
+  activeStealing = stealing && (size_ != 1);
+  if (activeStealing) {
+    // Done once MpiRequestPool sees the end of the tasks of all the ranks.
+    tasksLeft++;
+    if (tasksLeft == 1) {
+      MpiRequestPool::getInstance().localTasksDone();
+    }
+  }
 
   writtenDataRecorder.record(0);
   readDataRecorder.record(0);
 
   std::thread ioThread;
   std::thread mpiThread;
+  std::thread memoryThread;
   if (size_ != 1) {
     MpiRequestPool& mpi = MpiRequestPool::getInstance();
     // std::ref to avoid a copy.
@@ -495,6 +758,8 @@ void TaskScheduler::go(int n) {
   }
   IoThread& io = IoThread::getInstance();
   ioThread = std::thread(&IoThread::mainLoop, std::ref(io));
+  MemoryManager& memory = MemoryManager::getInstance();
+  memoryThread = std::thread(&MemoryManager::mainLoop, std::ref(memory));
 
   if (workers.size() != 0) {
     assert(workers.size() == n);
@@ -530,6 +795,9 @@ void TaskScheduler::go(int n) {
     mpi.pleaseStop();
     mpiThread.join();
   }
+  // The memory manager pushes requests to the IO thread.
+  memory.pleaseStop();
+  memoryThread.join();
   io.pleaseStop();
   ioThread.join();
   recorder.tag("Done");
@@ -549,14 +817,19 @@ void TaskScheduler::go(int n) {
   tasks.clear();
   tasksLeft = 0;
   totalTasks = 0;
+  mpiTaskCount = 0;
+  remoteTasks.clear();
+  usedOnNode.clear();
+  activeStealing = false;
 
   dataSizeRecorder.toFile("data_size.txt");
   writtenDataRecorder.toFile("data_written.txt");
   readDataRecorder.toFile("data_read.txt");
 }
 
-/*! \brief Returns a worker id (-3 for the master thread, -2 for IO thread, -1
- * for the MPI thread, 0 to N-1 for the workers)
+/*! \brief Returns a worker id (-4 for the memory manager thread, -3 for the
+ * master thread, -2 for IO thread, -1 for the MPI thread, 0 to N-1 for the
+ * workers)
  */
 int TaskScheduler::currentId() const {
   auto id = std::this_thread::get_id();
@@ -575,19 +848,24 @@ int TaskScheduler::currentId() const {
   // IO thread
   if (id == IoThread::getInstance().myId) return -2;
 
+  // Memory manager thread
+  if (id == MemoryManager::getInstance().myId) return -4;
+
   // Master thread
   return -3;
 }
 
 /*! \brief Returns a worker id (-1 for the master thread, 0 for the IO thread, 1
-   for the MPI thread, >=2 for the workers)
+   for the MPI thread, 2 for the memory manager thread, >=3 for the workers)
 
     It will be called by the 'context' timer system by setting the pointer
    nodeIndexFunction in ToyRTEngine<T>::init().
   */
 int toyrtWorkerId() {
   TaskScheduler& s = TaskScheduler::getInstance();
-  return s.currentId() + 2;
+  int id = s.currentId();
+  if (id == -4) return 2;
+  return (id >= 0 ? id + 3 : id + 2);
 }
 
 void TaskScheduler::dumpTimeline(const char* filename) const {
@@ -609,6 +887,15 @@ void TaskScheduler::dumpTimeline(const char* filename) const {
   f << "]" << std::endl;
 }
 
+int64_t TaskScheduler::nextAccess(Data* d) const {
+  auto it = dataAccess.find(d);
+  if ((it == dataAccess.end()) || it->second.pending.empty()) {
+    return -1;
+  }
+  int next = it->second.pending.front();
+  return (((int64_t)succ[next].depth) << 32) + next;
+}
+
 void TaskScheduler::unregisterData(Data* d) {
   auto it = dataAccess.find(d);
   if (it != dataAccess.end()) {
@@ -1,4 +1,5 @@
 #pragma once
+#include <atomic>
 #include <condition_variable>
 #include <deque>
 #include <functional>
@@ -9,14 +10,14 @@
 #include <vector>
 
 #include "context/data_recorder.hpp"
-#include "lru.hpp"
+#include "data.hpp"
+#include "eviction.hpp"
 #include "mpi.hpp"
+#include "placement.hpp"
 #include "scheduler.hpp"
 #include "task.hpp"
 #include "worker.hpp"
 
-class Data;
-
 int toyrtWorkerId();
 
 /** Main class for the toyRT runtime.
@@ -25,20 +26,26 @@ int toyrtWorkerId();
     TaskScheduler::getInstance().
 */
 class TaskScheduler {
+  friend class MemoryManager;
   /// Tasks successors: the in-degree and the out edges
   struct TaskSuccessors {
     int count;  // number of predecessors
     std::deque<int> successors;
+    int depth;  // length of the longest path from a task without predecessor
   };
   /// Tracker for the last read and write dependency on some data.
   struct AccessTracker {
     int lastWrite;
     std::deque<int> lastReads;
+    /// Tasks accessing the data that are not done yet, in submission order.
+    std::deque<int> pending;
 
-    AccessTracker() : lastWrite(-1), lastReads() {}
+    AccessTracker() : lastWrite(-1), lastReads(), pending() {}
   };
 
  private:
+  /** The instance, NULL once destroyed, see forgetData(). */
+  static TaskScheduler* live;
   /** Live and dead pointers to the tasks. This is used to match a task index to
       a Task* */
   std::vector<std::unique_ptr<Task>> tasks;
@@ -82,20 +89,73 @@ class TaskScheduler {
   /** MPI rank in mpiComm_ and size of the communicator. */
   int rank_, size_;
   MPI_Comm mpiComm_;
+  /** Number of tasks inserted by insertMpiTask() so far, the same on all the
+      ranks. */
+  int mpiTaskCount;
+  /** Tasks placed on other ranks that this rank can steal, by
+      Task::stealId. */
+  std::unordered_map<int, std::unique_ptr<Task>> remoteTasks;
+  /** Nodes accessing each data in the tasks inserted so far, either to run
+      a task or for a transfer. Only maintained with \a stealing. */
+  std::unordered_map<Data*, HolderSet> usedOnNode;
+  /** \a stealing in the current go(), with more than one rank. The tasks of
+      all the ranks are then accounted as one extra task in \a tasksLeft. */
+  bool activeStealing;
 
  public:
   /** Maximum total data size before starting to swap. Defaults to unlimited. */
   size_t maxMemorySize;
-  /** Least recently used Data instances */
-  Lru<Data> lru;
-  /** Mutex protecting the accesses to the LRU. */
+  /** In-core Data instances that can be evicted, and the choice of the next
+      one to evict. Defaults to a LruEvictionPolicy. */
+  std::unique_ptr<EvictionPolicy> evictionPolicy;
+  /** Mutex protecting the accesses to the eviction policy. */
   std::mutex lruMutex;
   /** Total number of inserted tasks. */
   int totalTasks;
+  /** Number of levels of successors of the ready tasks whose data are
+      prefetched ahead of time. Defaults to 0 (no lookahead). */
+  int lookaheadDepth;
+  /** Memory budget for the data prefetched ahead of time, which can't be
+      evicted until the tasks using them run. Capped by maxMemorySize, 0
+      (default) means maxMemorySize / 4. */
+  size_t lookaheadMemorySize;
+  /** If true, the data of a ready task are only fetched and pinned in core if
+      they fit in maxMemorySize along with the data already pinned, plus the
+      scratch memory (see Task::scratchSize()) of the running tasks. The other
+      ready tasks are deferred: the workers only start them once their working
+      set fits, when their data are already in core, or when nothing else
+      runs. Must be set before go(). Defaults to false. */
+  bool admissionControl;
+  /** Choice of the executing rank of the tasks inserted by insertMpiTask()
+      without one. Reset by setMpiComm(). */
+  PlacementEngine placement;
+  /** Let the idle ranks steal ready tasks from the busy ones (see
+      MpiRequestPool). A task inserted by insertMpiTask() can be stolen by a
+      rank that doesn't access its data otherwise, see canSteal(), if sending
+      its data back and forth (PlacementEngine::offloadCost()) costs less than
+      waiting for the tasks queued before it, shared among the workers.
+
+      The other ranks keep the Task objects that they can steal until the end
+      of go(), so they must work on any rank, through their parameters only.
+      Must be the same on all the ranks, and set before inserting the tasks.
+      Defaults to false. */
+  bool stealing;
 
  private:
-  /** Total size of all the known data. */
-  size_t dataSize;
+  /** Total size of all the known data that are in memory. */
+  std::atomic<size_t> dataSize;
+  /** Size of the data pinned by lookaheadPrefetch() for tasks that are not
+      ready yet. Protected by lruMutex. */
+  size_t lookaheadSize;
+  /** Size of the data used by the ready or prefetched tasks (refCount > 0),
+      plus the scratch memory of the running tasks. Only maintained with
+      admissionControl. Modified with postTaskExecutionMutex held, except by
+      releaseTask(). */
+  std::atomic<size_t> pinnedSize;
+  /** Number of tasks admitted by admitTask() and not done yet. */
+  std::atomic<int> runningTasks;
+  /** Number of times admitTask() refused a task. */
+  std::atomic<size_t> rejectedTasks;
   TimedDataRecorder<size_t> dataSizeRecorder;
   TimedDataRecorder<size_t> writtenDataRecorder;
   TimedDataRecorder<size_t> readDataRecorder;
@@ -104,6 +164,7 @@ class TaskScheduler {
 
  public:
   ~TaskScheduler() {
+    live = NULL;
     // We always record this, in the same file.
     // TODO: Make the recording optional (and disabled by default)
     recorder.toFile("tasks.txt");
@@ -117,7 +178,7 @@ class TaskScheduler {
 
       @param task task to execute
       @param params Parameters and access modes
-      @param node node to execute the task on
+      @param node node to execute the task on, -1 to let \a placement choose
       @param priority priority of the task
    */
   void insertMpiTask(Task* task, const toyRT_DepsArray& params, int node = -1,
@@ -183,6 +244,7 @@ class TaskScheduler {
     mpiComm_ = c;
     MPI_Comm_size(mpiComm_, &size_);
     MPI_Comm_rank(mpiComm_, &rank_);
+    placement.setSize(size_);
   }
   int getMpiRank() { return rank_; }
   int getMpiSize() { return size_; }
@@ -195,6 +257,84 @@ class TaskScheduler {
   */
   void dumpTimeline(const char* filename) const;
 
+  /** Choose the Scheduler ordering the ready tasks, PriorityScheduler by
+      default.
+
+      Must be called before go().
+   */
+  template <typename S>
+  void useScheduler() {
+    availableTasks.reset(new S(&recorder));
+  }
+  /** Total size of the data in core, in bytes. */
+  size_t inCoreSize() const { return dataSize; }
+  /** Set the policy choosing the Data to swap out.
+
+      Must be called before go().
+   */
+  void setEvictionPolicy(std::unique_ptr<EvictionPolicy> policy) {
+    evictionPolicy = std::move(policy);
+  }
+  /** Estimated date of the next access to a Data.
+
+      The date of a task is its depth in the DAG, then its submission index, and
+      the next access is the first task accessing the data that is not done
+      yet. This must be called with postTaskExecutionMutex held, or outside of
+      go().
+
+      @param d the Data
+      @return the date (the larger, the later), -1 if the data will not be
+      accessed anymore.
+   */
+  int64_t nextAccess(Data* d) const;
+  /** Decide if a worker can start a ready task (see admissionControl).
+
+      A task is always admitted if no other task is running, so that the
+      execution progresses even if a single working set doesn't fit.
+
+      @param t the task
+      @param scratch set to the scratch size accounted for the task, to be
+      given to releaseTask() once it is done
+      @return true if the task can run now, in which case the prefetch of its
+      data has been started
+   */
+  bool admitTask(Task* t, size_t& scratch);
+  /** Account for the end of a task admitted by admitTask(). */
+  void releaseTask(size_t scratch) {
+    if (admissionControl) {
+      pinnedSize -= scratch;
+      runningTasks--;
+    }
+  }
+  /** Number of times a worker had to put back a task it could not start. */
+  size_t rejectedTaskCount() const { return rejectedTasks; }
+  /** Can a rank steal a task, see \a stealing ?
+
+      It can if it doesn't access the parameters of the task in the current
+      go() and doesn't have a valid copy of them, so that it can use its
+      instances of the Data as scratch space.
+   */
+  bool canSteal(Task* t, int rank);
+  /** Remove a ready task from the scheduler to be run by another rank, see
+      \a stealing.
+
+      @param thief the rank running the task
+      @param id set to the Task::stealId of the task
+      @return NULL if no task is worth it
+   */
+  Task* stealReadyTask(int thief, int& id);
+  /** Copy of a task stolen from another rank.
+
+      @param id the Task::stealId of the task
+   */
+  Task* stolenTask(int id);
+  /** Give a task to the workers, outside of the DAG. */
+  void pushStolenTask(Task* t) { availableTasks->push(t); }
+  /** Number of ready tasks waiting for a worker. */
+  int readyTaskCount() const { return availableTasks->size(); }
+  /** Account for the end of the tasks of all the ranks, see \a stealing. */
+  void stealingDone();
+
   /** Get the verbosity flag
    */
   bool verbose() const { return verbose_; }
@@ -205,6 +345,12 @@ class TaskScheduler {
     static TaskScheduler s;
     return s;
   }
+  /** Stop tracking a Data that is being destroyed.
+
+      This is called by Data::~Data(), and does nothing once the instance is
+      destroyed.
+   */
+  static void forgetData(Data* d);
   std::string getLocalization() const;
 
  private:
@@ -215,7 +361,36 @@ class TaskScheduler {
    */
   void notifyProgress();
   void startPrefetch(Task* t);
-  void evict();
+  /** Pin the data of a task in memory, and read the swapped ones.
+
+      Must be called with lruMutex held.
+
+      @return the size of the data that were not pinned yet.
+   */
+  size_t pinTaskData(Task* t);
+  /** startPrefetch() for a ready task, if its data fit in maxMemorySize with
+      the ones already pinned (see admissionControl).
+
+      Must be called with postTaskExecutionMutex held.
+
+      @param t the task
+      @param force pin the data even if they don't fit
+      @return true if the data were pinned
+   */
+  bool pinIfFits(Task* t, bool force);
+  /** Prefetch the data of the successors of a ready task, up to
+      lookaheadDepth levels and within the lookahead memory budget.
+
+      Must be called with postTaskExecutionMutex held, or from prepare().
+   */
+  void lookaheadPrefetch(Task* ready);
+  /** Swap data out until their total size gets below a target.
+
+      This is called by the MemoryManager thread, and only takes lruMutex.
+
+      @param target the size in bytes
+   */
+  void evict(size_t target);
   /** Private constructor, construction is not allowed. */
   TaskScheduler();
   TaskScheduler(const TaskScheduler&);  // No copy
@@ -227,6 +402,8 @@ class TaskScheduler {
       @param callbacks
    */
   void postTaskExecutionInternal(Task* task, std::vector<Task*>& callbacks);
+  /** Note that a node accesses some data, see \a usedOnNode. */
+  void markUsed(Data* d, int node);
 
  public:
   // Remove a Data from the data tracking.
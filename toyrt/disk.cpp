@@ -5,12 +5,17 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#include <fcntl.h>
+#include <limits.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 
 #include "data.hpp"
 #include "dependencies.hpp"
+#include "mapped.hpp"
 
 namespace {
 class FlushTask : public Task {
@@ -24,149 +29,265 @@ class FlushTask : public Task {
   }
   void call() {
     std::lock_guard<std::mutex> guard(TaskScheduler::getInstance().lruMutex);
-    TaskScheduler::getInstance().lru.putAsOldest(d);
+    TaskScheduler::getInstance().evictionPolicy->putAsOldest(d);
   }
 };
 
 }  // namespace
 
-/** File IO Backend.
- */
-class FileIoBackend : public IoBackend {
- private:
-  int index;
-  char* basedirName;
-  std::map<Data*, char*> dataToFilename;
+void IoBackend::writeData(Data* d) {
+  void* ptr;
+  // TODO: register alloc
+  ssize_t size = d->pack(&ptr);
+  writeBuffer(d, ptr, size);
+  // TODO: register free
+  free(ptr);
+}
 
- private:
-  void createBaseDirectory(const char* directory) {
-    const char* pattern = "/toyrt_ooc_XXXXXX";
-    basedirName = (char*)calloc(strlen(directory) + strlen(pattern) + 1, 1);
-    assert(basedirName);
-    sprintf(basedirName, "%s%s", directory, pattern);
-    assert(mkdtemp(basedirName));
-  }
-
-  void cleanup() {
-    // TODO: remove the directory hierarchy as well
-    for (auto p : dataToFilename) {
-      remove(p.second);
-      free(p.second);
-    }
-    dataToFilename.clear();
-  }
-
-  enum FileAccessMode { READ, WRITE };
-  FILE* openFile(Data* d, FileAccessMode access) {
-    FILE* f = NULL;
-    switch (access) {
-      case READ:
-        assert(dataToFilename.find(d) != dataToFilename.end());
-        f = fopen(dataToFilename[d], "rb");
-        break;
-      case WRITE: {
-        const int kFilesPerDir = 1000;
-        auto it = dataToFilename.find(d);
-        if (it == dataToFilename.end()) {
-          if (index % kFilesPerDir == 0) {
-            char* dirName = (char*)calloc(strlen(basedirName) + 10, 1);
-            sprintf(dirName, "%s/%04d", basedirName, index / kFilesPerDir);
-            int ierr = mkdir(dirName, S_IRWXU);
-            assert(!ierr);
-            free(dirName);
-          }
-          char* filename = (char*)calloc(strlen(basedirName) + 30, 1);
-          assert(filename);
-          sprintf(filename, "%s/%04d/%06d", basedirName, index / kFilesPerDir,
-                  index);
-          dataToFilename[d] = filename;
-          index++;
-        }
-        f = fopen(dataToFilename[d], "wb");
-        assert(f);
-      } break;
-    }
-    return f;
+void IoBackend::readData(Data* d) {
+  void* ptr = NULL;
+  // TODO: register alloc
+  size_t size = readBuffer(d, &ptr);
+  d->unpack(ptr, size);
+  // TODO: register free
+  free(ptr);
+}
+
+void FileIoBackend::createBaseDirectory(const char* directory) {
+  const char* pattern = "/toyrt_ooc_XXXXXX";
+  basedirName = (char*)calloc(strlen(directory) + strlen(pattern) + 1, 1);
+  assert(basedirName);
+  sprintf(basedirName, "%s%s", directory, pattern);
+  assert(mkdtemp(basedirName));
+}
+
+void FileIoBackend::cleanup() {
+  // TODO: remove the directory hierarchy as well
+  for (auto p : files) {
+    remove(p.second.name);
+    free(p.second.name);
+  }
+  files.clear();
+  extents.clear();
+}
+
+int FileIoBackend::createFile() {
+  const int kFilesPerDir = 1000;
+  if (index % kFilesPerDir == 0) {
+    char* dirName = (char*)calloc(strlen(basedirName) + 10, 1);
+    sprintf(dirName, "%s/%04d", basedirName, index / kFilesPerDir);
+    int ierr = mkdir(dirName, S_IRWXU);
+    assert(!ierr);
+    free(dirName);
+  }
+  char* filename = (char*)calloc(strlen(basedirName) + 30, 1);
+  assert(filename);
+  sprintf(filename, "%s/%04d/%06d", basedirName, index / kFilesPerDir, index);
+  files[index] = (File){filename, 0};
+  return index++;
+}
+
+void FileIoBackend::release(Data* d) {
+  auto it = extents.find(d);
+  if (it == extents.end()) {
+    return;
+  }
+  auto f = files.find(it->second.file);
+  assert(f != files.end());
+  if (--f->second.count == 0) {
+    remove(f->second.name);
+    free(f->second.name);
+    files.erase(f);
   }
+  extents.erase(it);
+}
 
-  void deleteData(Data* d) {
-    if (dataToFilename.find(d) != dataToFilename.end()) {
-      remove(dataToFilename[d]);
+void FileIoBackend::writeBuffers(const std::vector<Data*>& data,
+                                 const std::vector<const void*>& ptrs,
+                                 const std::vector<size_t>& sizes) {
+  int file = createFile();
+  int fd =
+      open(files[file].name, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  assert(fd >= 0);
+  std::vector<struct iovec> iov;
+  size_t offset = 0;
+  for (size_t i = 0; i < data.size(); i++) {
+    release(data[i]);
+    extents[data[i]] = (Extent){file, offset, sizes[i]};
+    files[file].count++;
+    offset += sizes[i];
+    if (sizes[i]) {
+      struct iovec v;
+      v.iov_base = const_cast<void*>(ptrs[i]);
+      v.iov_len = sizes[i];
+      iov.push_back(v);
+    }
+  }
+  // writev() may write less than asked, and takes at most IOV_MAX buffers.
+  size_t first = 0;
+  while (first < iov.size()) {
+    int n = (int)std::min(iov.size() - first, (size_t)IOV_MAX);
+    ssize_t written = writev(fd, &iov[first], n);
+    assert(written > 0);
+    while ((first < iov.size()) && ((size_t)written >= iov[first].iov_len)) {
+      written -= iov[first].iov_len;
+      first++;
+    }
+    if (written > 0) {
+      iov[first].iov_base = (char*)iov[first].iov_base + written;
+      iov[first].iov_len -= written;
     }
   }
+  int ierr = close(fd);
+  assert(!ierr);
+}
 
- public:
-  FileIoBackend(const char* directory = "/tmp") : index(0) {
-    createBaseDirectory(directory);
+void FileIoBackend::deleteData(Data* d) { release(d); }
+
+FileIoBackend::FileIoBackend(const char* directory) : index(0) {
+  createBaseDirectory(directory);
+}
+
+FileIoBackend::~FileIoBackend() { cleanup(); }
+
+size_t FileIoBackend::writeBatch(const std::vector<Data*>& batch) {
+  if (batch.empty()) {
+    return 0;
   }
-  ~FileIoBackend() { cleanup(); }
-  void writeData(Data* d) {
-    FILE* f = openFile(d, WRITE);
-    assert(f);
+  std::vector<const void*> ptrs;
+  std::vector<size_t> sizes;
+  for (Data* d : batch) {
     void* ptr;
     // TODO: register alloc
-    ssize_t size = d->pack(&ptr);
-    size_t written = fwrite(ptr, 1, size, f);
-    assert(written == size);
-    fclose(f);
-    // TODO: register free
-    free(ptr);
-  }
-  void readData(Data* d) {
-    FILE* f = openFile(d, READ);
-    // Get the size
-    fseek(f, 0L, SEEK_END);
-    size_t size = ftell(f);
-    rewind(f);
-    // TODO: register alloc
-    void* ptr = calloc(size, 1);
-    assert(ptr);
-    size_t readSize = fread(ptr, 1, size, f);
-    assert(readSize == size);
-    fclose(f);
-    d->unpack(ptr, size);
+    sizes.push_back(d->pack(&ptr));
+    ptrs.push_back(ptr);
+  }
+  writeBuffers(batch, ptrs, sizes);
+  for (const void* ptr : ptrs) {
     // TODO: register free
-    free(ptr);
+    free(const_cast<void*>(ptr));
   }
-};
+  return batch.size() - 1;
+}
+
+void FileIoBackend::writeBuffer(Data* d, const void* ptr, size_t size) {
+  writeBuffers({d}, {ptr}, {size});
+}
+
+size_t FileIoBackend::readBuffer(Data* d, void** ptr) {
+  auto it = extents.find(d);
+  assert(it != extents.end());
+  const Extent& e = it->second;
+  FILE* f = fopen(files[e.file].name, "rb");
+  assert(f);
+  fseek(f, (long)e.offset, SEEK_SET);
+  *ptr = malloc(e.size);
+  assert(*ptr || !e.size);
+  size_t readSize = fread(*ptr, 1, e.size, f);
+  assert(readSize == e.size);
+  fclose(f);
+  return e.size;
+}
 
 void IoThread::pushSwap(Data* d) {
   assert(d->swappable);
   assert(!d->swapped);
   d->swapped = true;
-  enqueueRequest(std::unique_ptr<Request>(new Request(WRITE, d)));
+  std::lock_guard<std::mutex> lock(requestsMutex);
+  writes.emplace_back(new Request(WRITE, d));
+  pendingWrites[d] = writes.back().get();
+  sleepConditionIO.notify_one();
 }
 
-void IoThread::pushPrefetch(Data* d) {
+bool IoThread::pushPrefetch(Data* d) {
   assert(d->swappable);
   assert(d->swapped);
-  enqueueRequest(std::unique_ptr<Request>(new Request(READ, d)));
+  std::lock_guard<std::mutex> lock(requestsMutex);
+  auto it = pendingWrites.find(d);
+  if (it != pendingWrites.end()) {
+    // The data is still in memory: forget about the swap-out.
+    it->second->cancelled = true;
+    pendingWrites.erase(it);
+    d->swapped = false;
+    d->prefetchInFlight = false;
+    cancelled++;
+    return false;
+  }
+  reads.emplace_back(new Request(READ, d));
+  sleepConditionIO.notify_one();
+  return true;
 }
 
-void IoThread::pleaseStop() { enqueueRequest(nullptr); }
-
-void IoThread::enqueueRequest(std::unique_ptr<Request> r) {
+void IoThread::pleaseStop() {
   std::lock_guard<std::mutex> lock(requestsMutex);
-  requests.push_front(std::move(r));
+  stopRequested = true;
   sleepConditionIO.notify_one();
 }
 
-void IoThread::processRequest(Request* r) {
+void IoThread::popRequests(std::vector<std::unique_ptr<Request>>& batch) {
+  if (!reads.empty()) {
+    batch.push_back(std::move(reads.front()));
+    reads.pop_front();
+    return;
+  }
+  size_t batchSize = 0;
+  while (!writes.empty()) {
+    Request* r = writes.front().get();
+    if (r->cancelled) {
+      writes.pop_front();
+      continue;
+    }
+    // Only consecutive WRITE requests are batched.
+    if (!batch.empty() && ((r->type != WRITE) || (batch[0]->type != WRITE) ||
+                           (batchSize + r->d->oldSize > maxWriteBatchSize))) {
+      break;
+    }
+    if (r->type == WRITE) {
+      pendingWrites.erase(r->d);
+      batchSize += r->d->oldSize;
+    }
+    batch.push_back(std::move(writes.front()));
+    writes.pop_front();
+  }
+}
+
+void IoThread::processRequests(std::vector<std::unique_ptr<Request>>& batch) {
+  Request* r = batch[0].get();
   switch (r->type) {
     case READ: {
       // Prefetch
-      backend->readData(r->d);
+      MappedData* m = dynamic_cast<MappedData*>(r->d);
+      if (m) {
+        m->willNeed();
+      } else {
+        backend->readData(r->d);
+      }
       r->d->swapped = false;
       r->d->dirty = false;
       r->d->prefetchInFlight = false;
     } break;
     case WRITE: {
       // Swap
-      if (r->d->dirty) {
-        backend->writeData(r->d);
-        r->d->dirty = false;
+      std::vector<Data*> dirty;
+      for (const auto& w : batch) {
+        if (!w->d->dirty) {
+          continue;
+        }
+        // Mapped data are written back in place, and paged out below.
+        MappedData* m = dynamic_cast<MappedData*>(w->d);
+        if (m) {
+          m->sync();
+        } else {
+          dirty.push_back(w->d);
+        }
+      }
+      if (!dirty.empty()) {
+        coalesced += backend->writeBatch(dirty);
+      }
+      for (const auto& w : batch) {
+        w->d->dirty = false;
+        w->d->deallocate();
       }
-      r->d->deallocate();
     } break;
     case DELETE:
       backend->deleteData(r->d);
@@ -179,35 +300,37 @@ void IoThread::mainLoop() {
   {
     DECLARE_CONTEXT;
 
-    bool shouldStop = false;
-    bool shouldReallyStop = false;
-    while (!shouldReallyStop) {
-      std::unique_lock<std::mutex> lock(requestsMutex);
-      bool nothingToDo = requests.empty();
-      if (nothingToDo && (!shouldStop)) {
+    std::vector<std::unique_ptr<Request>> batch;
+    std::unique_lock<std::mutex> lock(requestsMutex);
+    while (true) {
+      if (reads.empty() && writes.empty()) {
+        if (stopRequested) {
+          break;
+        }
         sleepConditionIO.wait(lock);
+        continue;
       }
-      shouldReallyStop = shouldStop && nothingToDo;
-      while (!requests.empty()) {
-        std::unique_ptr<Request> r = std::move(requests.back());
-        requests.pop_back();
-        lock.unlock();
-        if (!r) {
-          // The "stop" sentinel should be the last request
-          assert(requests.empty());
-          shouldStop = true;
-        } else {
-          processRequest(r.get());
-        }
-        lock.lock();
+      popRequests(batch);
+      if (batch.empty()) {
+        // Only cancelled requests were left.
+        continue;
       }
       lock.unlock();
+      processRequests(batch);
+      batch.clear();
+      lock.lock();
     }
+    stopRequested = false;
   }
   myId = static_cast<std::thread::id>(0);
 }
 
-IoThread::IoThread() : backend(new FileIoBackend()) {}
+IoThread::IoThread()
+    : stopRequested(false),
+      backend(new FileIoBackend()),
+      cancelled(0),
+      coalesced(0),
+      maxWriteBatchSize(4 * 1024 * 1024) {}
 
 void flushToDisk(Data* d) {
   TaskScheduler::getInstance().insertTask(
@@ -1,10 +1,14 @@
 #pragma once
+#include <atomic>
 #include <condition_variable>
-#include <list>
+#include <cstdio>
+#include <deque>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "task.hpp"
 
@@ -12,48 +16,180 @@ class DiskReadTask;
 class DiskWriteTask;
 
 /** Abstract Base class for an IO backend.
+
+    A backend stores the serialized version of the swapped data. The default
+    writeData() and readData() go through Data::pack() / Data::unpack() and
+    writeBuffer() / readBuffer(), so that the backends only deal with bytes and
+    can be stacked (see CompressingIoBackend).
  */
 class IoBackend {
  public:
   IoBackend() = default;
   virtual ~IoBackend() = default;
-  virtual void writeData(Data* d) = 0;
-  virtual void readData(Data* d) = 0;
+  virtual void writeData(Data* d);
+  /** Write several data at once.
+
+      The IO thread hands the consecutive swap-outs to this function, so that
+      the backends can merge them. The default implementation writes them one
+      by one.
+
+      @return the number of data written by the same operation as a previous
+      data of the batch
+   */
+  virtual size_t writeBatch(const std::vector<Data*>& batch) {
+    for (Data* d : batch) {
+      writeData(d);
+    }
+    return 0;
+  }
+  virtual void readData(Data* d);
   virtual void deleteData(Data* d) = 0;
+  /** Store a buffer as the swapped version of a data.
+
+      This replaces the buffer previously stored for the data, if any.
+
+      @param d the data
+      @param ptr the buffer, still owned by the caller
+      @param size buffer size in bytes
+   */
+  virtual void writeBuffer(Data* d, const void* ptr, size_t size) = 0;
+  /** Read back the buffer stored for a data.
+
+      @param d the data
+      @param ptr set to a buffer allocated with malloc(), that the caller must
+      free.
+      @return the buffer size in bytes
+   */
+  virtual size_t readBuffer(Data* d, void** ptr) = 0;
+};
+
+/** File IO Backend.
+
+    The data are stored in files of a temporary directory. writeBuffer() puts a
+    data in its own file, and writeBatch() puts all the data of a batch one
+    after the other in a single file, with a single vectored write. A file is
+    removed once none of its data is stored in it anymore.
+ */
+class FileIoBackend : public IoBackend {
+ private:
+  /** Location of the buffer stored for a data. */
+  struct Extent {
+    int file;  ///< file index, key of \a files
+    size_t offset;
+    size_t size;
+  };
+  /** A file and the number of data stored in it. */
+  struct File {
+    char* name;
+    int count;
+  };
+  int index;
+  char* basedirName;
+  std::map<Data*, Extent> extents;
+  std::map<int, File> files;
+
+ private:
+  void createBaseDirectory(const char* directory);
+  void cleanup();
+  /** Create a new file, and return its index in \a files. */
+  int createFile();
+  /** Forget the buffer stored for a data, and remove its file if it was the
+      last data stored in it. */
+  void release(Data* d);
+  /** Write buffers one after the other in a new file.
+
+      @param data the data, replacing the buffers previously stored for them
+      @param ptrs the buffers, still owned by the caller
+      @param sizes buffer sizes in bytes
+   */
+  void writeBuffers(const std::vector<Data*>& data,
+                    const std::vector<const void*>& ptrs,
+                    const std::vector<size_t>& sizes);
+
+ public:
+  FileIoBackend(const char* directory = "/tmp");
+  ~FileIoBackend();
+  void deleteData(Data* d);
+  size_t writeBatch(const std::vector<Data*>& batch);
+  void writeBuffer(Data* d, const void* ptr, size_t size);
+  size_t readBuffer(Data* d, void** ptr);
 };
 
+/** IO thread, performing the swap requests of the TaskScheduler.
+
+    The reads (prefetches for ready tasks) are served before the writes (swaps
+    done in the background to make room). A swap-out that has not started yet
+    is cancelled if the data is prefetched again, and the consecutive
+    swap-outs are handed to the backend as a single batch.
+ */
 class IoThread {
  private:
   enum RequestType { READ, WRITE, DELETE };
   struct Request {
     RequestType type;
     Data* d;
+    bool cancelled;  ///< true if the request must be skipped
     // No task associated with the request: for swapping requests
-    Request(RequestType type, Data* d) : type(type), d(d) {}
+    Request(RequestType type, Data* d) : type(type), d(d), cancelled(false) {}
   };
 
-  std::list<std::unique_ptr<Request>> requests;
+  /** Pending READ requests. */
+  std::deque<std::unique_ptr<Request>> reads;
+  /** Pending WRITE and DELETE requests. */
+  std::deque<std::unique_ptr<Request>> writes;
+  /** Data -> WRITE request in \a writes that has not started yet. */
+  std::unordered_map<Data*, Request*> pendingWrites;
+  /** true once pleaseStop() has been called. */
+  bool stopRequested;
+  /** Protects \a reads, \a writes, \a pendingWrites and \a stopRequested */
   std::mutex requestsMutex;
   /** Used to sleep if no request is to be processed by the IO thread. */
   std::condition_variable sleepConditionIO;
   std::unique_ptr<IoBackend> backend;
+  /** Number of swap-outs cancelled by a prefetch of the same data. */
+  std::atomic<size_t> cancelled;
+  /** Number of swap-outs written by the backend in the same operation as a
+      previous one. */
+  std::atomic<size_t> coalesced;
 
  public:
+  /** Maximum size in bytes of a batch of swap-outs. 4 MB by default. */
+  size_t maxWriteBatchSize;
   // thread id of the io thread
   std::thread::id myId;
 
+  /** Replace the IO backend.
+
+      Must not be called while the IO thread is running (during go()).
+   */
+  void setBackend(std::unique_ptr<IoBackend> b) { backend = std::move(b); }
+  IoBackend& getBackend() { return *backend; }
   void pushSwap(Data* d);
-  void pushPrefetch(Data* d);
+  /** Enqueue the read of a swapped data.
+
+      @return false if the data had not been written yet, in which case the
+      swap-out is cancelled and the data is in memory when this returns.
+   */
+  bool pushPrefetch(Data* d);
   void mainLoop();
   void pleaseStop();
+  /** Number of swap-outs cancelled by a prefetch. */
+  size_t cancelledRequests() const { return cancelled; }
+  /** Number of swap-outs written in the same operation as a previous one, see
+      IoBackend::writeBatch(). */
+  size_t coalescedRequests() const { return coalesced; }
   static IoThread& getInstance() {
     static IoThread io;
     return io;
   }
 
  private:
-  void enqueueRequest(std::unique_ptr<Request> r);
-  void processRequest(Request* r);
+  /** Pop the next requests to process, with requestsMutex held.
+
+      @param batch the requests, several WRITE requests when coalescing
+   */
+  void popRequests(std::vector<std::unique_ptr<Request>>& batch);
+  void processRequests(std::vector<std::unique_ptr<Request>>& batch);
   IoThread();
   IoThread(const IoThread&) = delete;
   ~IoThread() = default;
@@ -0,0 +1,57 @@
+#include "distribution.hpp"
+
+#include <cassert>
+#include <cmath>
+
+int Distribution::distribute(int rows, int cols,
+                             const std::function<Data*(int, int)>& data,
+                             int firstTag) const {
+  assert(firstTag != 0);
+  int tag = firstTag;
+  for (int j = 0; j < cols; j++) {
+    for (int i = 0; i < rows; i++) {
+      Data* d = data(i, j);
+      d->rank = owner(i, j);
+      d->tag = tag++;
+    }
+  }
+  return tag;
+}
+
+BlockCyclic1D::BlockCyclic1D(int size, bool byRows)
+    : size(size), byRows(byRows) {
+  assert(size > 0);
+}
+
+int BlockCyclic1D::owner(int i, int j) const {
+  return (byRows ? i : j) % size;
+}
+
+BlockCyclic2D::BlockCyclic2D(int size) : p(1), q(size) {
+  assert(size > 0);
+  for (int d = (int)std::sqrt((double)size); d > 1; d--) {
+    if (size % d == 0) {
+      p = d;
+      q = size / d;
+      break;
+    }
+  }
+}
+
+BlockCyclic2D::BlockCyclic2D(int p, int q) : p(p), q(q) {
+  assert((p > 0) && (q > 0));
+}
+
+int BlockCyclic2D::owner(int i, int j) const {
+  return (i % p) + (j % q) * p;
+}
+
+int ownerComputes(const toyRT_DepsArray& params) {
+  assert(!params.empty());
+  for (const auto& p : params) {
+    if (p.second == toyRT_WRITE) {
+      return ((Data*)p.first)->rank;
+    }
+  }
+  return ((Data*)params[0].first)->rank;
+}
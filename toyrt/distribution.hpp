@@ -0,0 +1,82 @@
+#pragma once
+#include <functional>
+
+#include "data.hpp"
+#include "task.hpp"
+
+/** Mapping of a 2D collection of data, such as the tiles of a matrix, to the
+    MPI ranks.
+
+    distribute() sets Data::rank and Data::tag for a whole collection, and
+    ownerComputes() gives the matching placement hint for
+    TaskScheduler::insertMpiTask().
+ */
+class Distribution {
+ public:
+  virtual ~Distribution() {}
+  /** Rank owning the element (i, j) of the collection. */
+  virtual int owner(int i, int j) const = 0;
+  /** Set the rank and the tag of the elements of a collection.
+
+      The tags are consecutive, in column major order.
+
+      @param rows number of rows of the collection
+      @param cols number of columns of the collection
+      @param data returns the element (i, j)
+      @param firstTag tag of the element (0, 0), must not be 0
+      @return the tag following the last one used
+   */
+  int distribute(int rows, int cols,
+                 const std::function<Data*(int, int)>& data,
+                 int firstTag) const;
+};
+
+/** 1D block cyclic distribution of the rows, or the columns, over all the
+    ranks. */
+class BlockCyclic1D : public Distribution {
+ private:
+  int size;
+  bool byRows;
+
+ public:
+  /** Constructor.
+
+      @param size number of ranks
+      @param byRows true to distribute the rows, false for the columns
+   */
+  BlockCyclic1D(int size, bool byRows = true);
+  int owner(int i, int j) const override;
+};
+
+/** 2D block cyclic distribution over a p x q grid of ranks, the ranks being
+    numbered in column major order in the grid. */
+class BlockCyclic2D : public Distribution {
+ private:
+  int p, q;
+
+ public:
+  /** Distribution over the grid closest to a square with \a size ranks. */
+  explicit BlockCyclic2D(int size);
+  BlockCyclic2D(int p, int q);
+  int owner(int i, int j) const override;
+  int gridRows() const { return p; }
+  int gridCols() const { return q; }
+};
+
+/** Distribution given by a user function. */
+class CustomDistribution : public Distribution {
+ private:
+  std::function<int(int, int)> mapper;
+
+ public:
+  CustomDistribution(std::function<int(int, int)> mapper)
+      : mapper(std::move(mapper)) {}
+  int owner(int i, int j) const override { return mapper(i, j); }
+};
+
+/** Owner computes placement hint for TaskScheduler::insertMpiTask().
+
+    @return the rank of the first written parameter, or of the first parameter
+    if none is written.
+ */
+int ownerComputes(const toyRT_DepsArray& params);
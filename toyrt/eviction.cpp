@@ -0,0 +1,57 @@
+#include "eviction.hpp"
+
+#include <iterator>
+#include <limits>
+
+#include "dependencies.hpp"
+
+void FurthestNextUsePolicy::put(Data* d, int64_t key) {
+  auto it = keys.find(d);
+  if (it != keys.end()) {
+    queue.erase(std::make_pair(it->second, d));
+    it->second = key;
+  } else {
+    keys[d] = key;
+  }
+  queue.insert(std::make_pair(key, d));
+}
+
+void FurthestNextUsePolicy::put(Data* d) {
+  int64_t next = TaskScheduler::getInstance().nextAccess(d);
+  // Data that will never be accessed again go right after the flushed ones.
+  put(d, next == -1 ? std::numeric_limits<int64_t>::max() - 1 : next);
+}
+
+void FurthestNextUsePolicy::putAsOldest(Data* d) {
+  put(d, std::numeric_limits<int64_t>::max());
+}
+
+void FurthestNextUsePolicy::refresh(Data* d) {
+  auto it = keys.find(d);
+  // The flushed data stay first.
+  if ((it != keys.end()) &&
+      (it->second != std::numeric_limits<int64_t>::max())) {
+    put(d);
+  }
+}
+
+bool FurthestNextUsePolicy::remove(Data* d) {
+  auto it = keys.find(d);
+  if (it == keys.end()) {
+    return false;
+  }
+  queue.erase(std::make_pair(it->second, d));
+  keys.erase(it);
+  return true;
+}
+
+Data* FurthestNextUsePolicy::removeVictim() {
+  if (queue.empty()) {
+    return NULL;
+  }
+  auto last = std::prev(queue.end());
+  Data* d = last->second;
+  queue.erase(last);
+  keys.erase(d);
+  return d;
+}
@@ -0,0 +1,93 @@
+#pragma once
+#include <cstdint>
+#include <set>
+#include <unordered_map>
+#include <utility>
+
+#include "data.hpp"
+#include "lru.hpp"
+
+/** Abstract base class for the OOC eviction policies.
+
+    The policy tracks the Data instances that are in core and not used by any
+    ready task, and chooses which one to swap out when room is needed. All the
+    calls are made with TaskScheduler::lruMutex held.
+ */
+class EvictionPolicy {
+ public:
+  EvictionPolicy() = default;
+  virtual ~EvictionPolicy() = default;
+  /** Track a data that is no longer used by any ready task.
+
+      If the data is already tracked, its position is refreshed.
+   */
+  virtual void put(Data* d) = 0;
+  /** Track a data and make it the next one to be evicted.
+   */
+  virtual void putAsOldest(Data* d) = 0;
+  /** Stop tracking a data, because a ready task needs it.
+
+      @return true if the data was tracked, false otherwise
+   */
+  virtual bool remove(Data* d) = 0;
+  /** Return true if the data is tracked.
+   */
+  virtual bool contains(Data* d) const = 0;
+  /** The next task accessing a data changed, because a task was submitted or
+      completed. Nothing is done if the data is not tracked.
+   */
+  virtual void refresh(Data* d) {}
+  /** Stop tracking the best data to evict, and return it.
+
+      @return the data, NULL if no data is tracked.
+   */
+  virtual Data* removeVictim() = 0;
+  /** Policy name, for the reports.
+   */
+  virtual const char* name() const = 0;
+};
+
+/** Evict the least recently used data.
+ */
+class LruEvictionPolicy : public EvictionPolicy {
+ private:
+  Lru<Data> lru;
+
+ public:
+  void put(Data* d) { lru.put(d); }
+  void putAsOldest(Data* d) { lru.putAsOldest(d); }
+  bool remove(Data* d) { return lru.remove(d); }
+  bool contains(Data* d) const { return lru.contains(d); }
+  Data* removeVictim() { return lru.removeOldest(); }
+  const char* name() const { return "lru"; }
+};
+
+/** Evict the data whose next use is the furthest away (Belady's policy).
+
+    The future is given by the submitted DAG: the next use of a Data is the
+    first task accessing it that has not been executed yet, and the tasks are
+    assumed to run by increasing depth in the DAG (see
+    TaskScheduler::nextAccess()). Data that are not accessed anymore go first,
+    followed by the data whose next reader or writer is the deepest. The key of
+    a tracked data is updated by refresh() when its next use changes.
+
+    The operations are O(log(N)) for N tracked data.
+ */
+class FurthestNextUsePolicy : public EvictionPolicy {
+ private:
+  /** (next use, data), the victim being the last element. */
+  std::set<std::pair<int64_t, Data*> > queue;
+  /** Data -> key in \a queue */
+  std::unordered_map<Data*, int64_t> keys;
+
+  void put(Data* d, int64_t key);
+
+ public:
+  void put(Data* d);
+  void putAsOldest(Data* d);
+  bool remove(Data* d);
+  bool contains(Data* d) const { return keys.find(d) != keys.end(); }
+  void refresh(Data* d);
+  Data* removeVictim();
+  const char* name() const { return "furthest-next-use"; }
+};
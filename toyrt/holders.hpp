@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/** Set of ranks, with an integer value for each one.
+
+    This is used by MpiDataCache to track the ranks holding a valid copy of a
+    Data, and is embedded in Data. Most data are only held by a few ranks, so
+    up to \a kInline ranks are stored in the set itself, without allocation.
+    Beyond that, the ranks are moved to an allocated array, along with a
+    bitmap of the ranks. contains() is O(1) in both cases, erase() and clear()
+    are O(size()).
+
+    Like LruHook, copying a set gives an empty set.
+*/
+class HolderSet {
+ public:
+  struct Holder {
+    int rank;
+    int value;
+  };
+
+ private:
+  static const size_t kInline = 4;
+  /** Storage once there were more than kInline ranks */
+  struct Spill {
+    std::vector<Holder> holders;
+    std::vector<uint64_t> bits;  ///< Bitmap of the ranks in \a holders
+  };
+  Holder small[kInline];
+  size_t count;
+  Spill* spill;
+
+  Holder* data() { return spill ? spill->holders.data() : small; }
+
+ public:
+  HolderSet() : count(0), spill(NULL) {}
+  HolderSet(const HolderSet&) : count(0), spill(NULL) {}
+  HolderSet& operator=(const HolderSet&) { return *this; }
+  ~HolderSet() { delete spill; }
+
+  size_t size() const { return count; }
+  const Holder* begin() const { return spill ? spill->holders.data() : small; }
+  const Holder* end() const { return begin() + count; }
+
+  bool contains(int rank) const {
+    if (spill) {
+      const size_t word = rank / 64;
+      return (word < spill->bits.size()) &&
+             ((spill->bits[word] >> (rank % 64)) & 1);
+    }
+    for (size_t i = 0; i < count; i++) {
+      if (small[i].rank == rank) return true;
+    }
+    return false;
+  }
+  /** Value of a rank, that must be in the set. */
+  int& value(int rank) {
+    Holder* h = data();
+    for (size_t i = 0; i < count; i++) {
+      if (h[i].rank == rank) return h[i].value;
+    }
+    assert(false && "rank not in the set");
+    return h[0].value;
+  }
+  /** Add a rank, that must not be in the set. */
+  void insert(int rank, int value) {
+    assert(!contains(rank));
+    if (!spill && (count < kInline)) {
+      small[count++] = Holder{rank, value};
+      return;
+    }
+    if (!spill) {
+      spill = new Spill();
+      spill->holders.assign(small, small + count);
+      for (size_t i = 0; i < count; i++) {
+        setBit(small[i].rank);
+      }
+    }
+    spill->holders.push_back(Holder{rank, value});
+    setBit(rank);
+    count++;
+  }
+  /** Remove a rank, if it is in the set. The order of the others changes. */
+  void erase(int rank) {
+    Holder* h = data();
+    for (size_t i = 0; i < count; i++) {
+      if (h[i].rank != rank) continue;
+      h[i] = h[count - 1];
+      count--;
+      if (spill) {
+        spill->holders.pop_back();
+        spill->bits[rank / 64] &= ~((uint64_t)1 << (rank % 64));
+      }
+      return;
+    }
+  }
+  void clear() {
+    delete spill;
+    spill = NULL;
+    count = 0;
+  }
+
+ private:
+  void setBit(int rank) {
+    const size_t word = rank / 64;
+    if (spill->bits.size() <= word) {
+      spill->bits.resize(word + 1, 0);
+    }
+    spill->bits[word] |= (uint64_t)1 << (rank % 64);
+  }
+};
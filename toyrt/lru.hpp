@@ -1,7 +1,24 @@
 #pragma once
 
-#include <map>
-#include <unordered_map>
+#include <cassert>
+#include <cstddef>
+
+/** Links used by \a Lru<V> to chain the values together.
+
+    The LRU is intrusive: the values embed one hook per LRU they can be stored
+    in, so that no allocation is needed to track them. Copying a value does not
+    copy its links, the copy starts outside of any LRU.
+*/
+template <typename V>
+struct LruHook {
+  V* prev;      ///< Previous (older) value, NULL for the oldest one
+  V* next;      ///< Next (more recent) value, NULL for the most recent one
+  bool linked;  ///< true if the value is currently in an LRU
+
+  LruHook() : prev(NULL), next(NULL), linked(false) {}
+  LruHook(const LruHook&) : prev(NULL), next(NULL), linked(false) {}
+  LruHook& operator=(const LruHook&) { return *this; }
+};
 
 /** Limited LRU (Least Recently Used) data structure.
 
@@ -9,38 +26,60 @@
     collection. Note that contrary to the usual LRU caches, there is no
     distinction between the key and the value, and we only store pointers.
 
+    The LRU is an intrusive doubly-linked list going from the oldest to the most
+    recent value, the links being stored in the values themselves (see \a
+    LruHook). By default, the hook is the member V::lruHook.
+
     The asympotic complexity of the operations are :
-    - Insertion / refresh : O(1) + O(log(N)) for N items in the LRU.
-    - remove: O(1) + O(log(N))
+    - Insertion / refresh : O(1)
+    - remove: O(1)
     - removeOldest: O(1)
+    None of them allocates memory.
 
     @warning this class is not thread-safe, don't do insertions / removal at the
     same time from different threads.
+    @warning A value can only be in a single LRU per hook.
+    @warning A value must be removed before being destroyed.
 */
-template <typename V>
+template <typename V, LruHook<V> V::*Hook = &V::lruHook>
 class Lru {
  private:
-  int64_t current;
-  std::unordered_map<V*, int64_t> toSequence;
-  std::map<int64_t, V*> fromSequence;
+  V* oldest;
+  V* newest;
+  size_t count;
 
  public:
-  Lru() : current(0), toSequence(), fromSequence() {}
+  Lru() : oldest(NULL), newest(NULL), count(0) {}
+  /** The values may be destroyed before the LRU, so they are not touched. */
+  ~Lru() {
+    oldest = NULL;
+    newest = NULL;
+    count = 0;
+  }
 
  private:
-  void put(V* v, bool oldest) {
-    // If the value is already here with a different sequence number, remove the
-    // mapping with the old sequence number.
-    auto toIt = toSequence.find(v);
-    if (toIt != toSequence.end()) {
-      auto fromIt = fromSequence.find(toIt->second);
-      fromSequence.erase(fromIt);
+  Lru(const Lru&) = delete;
+  Lru& operator=(const Lru&) = delete;
+
+  static LruHook<V>& hook(V* v) { return v->*Hook; }
+
+  void unlink(V* v) {
+    LruHook<V>& h = hook(v);
+    assert(h.linked);
+    if (h.prev) {
+      hook(h.prev).next = h.next;
+    } else {
+      oldest = h.next;
     }
-    int64_t sign = oldest ? -1 : 1;
-    int64_t sequence = sign * current;
-    toSequence[v] = sequence;
-    fromSequence[sequence] = v;
-    ++current;
+    if (h.next) {
+      hook(h.next).prev = h.prev;
+    } else {
+      newest = h.prev;
+    }
+    h.prev = NULL;
+    h.next = NULL;
+    h.linked = false;
+    --count;
   }
 
  public:
@@ -51,7 +90,22 @@ class Lru {
 
       @param v the value to insert/refresh
    */
-  void put(V* v) { put(v, false); }
+  void put(V* v) {
+    if (hook(v).linked) {
+      unlink(v);
+    }
+    LruHook<V>& h = hook(v);
+    h.prev = newest;
+    h.next = NULL;
+    h.linked = true;
+    if (newest) {
+      hook(newest).next = v;
+    } else {
+      oldest = v;
+    }
+    newest = v;
+    ++count;
+  }
 
   /** Mark a data as the oldest one in the LRU.
 
@@ -60,36 +114,58 @@ class Lru {
 
       @param v the value to insert/refresh
    */
-  void putAsOldest(V* v) { put(v, true); }
+  void putAsOldest(V* v) {
+    if (hook(v).linked) {
+      unlink(v);
+    }
+    LruHook<V>& h = hook(v);
+    h.prev = NULL;
+    h.next = oldest;
+    h.linked = true;
+    if (oldest) {
+      hook(oldest).prev = v;
+    } else {
+      newest = v;
+    }
+    oldest = v;
+    ++count;
+  }
   /** Remove a value from the LRU, if it exists.
 
       @param v value to remove
       @return true if the value exists in the LRU, false otherwise
    */
   bool remove(V* v) {
-    auto toIt = toSequence.find(v);
-    if (toIt == toSequence.end()) {
+    if (!hook(v).linked) {
       return false;
     }
-    fromSequence.erase(fromSequence.find(toIt->second));
-    toSequence.erase(toIt);
+    unlink(v);
     return true;
   }
   /** Return true if v is in the LRU.
    */
-  bool contains(V* v) const { return toSequence.find(v) != toSequence.end(); }
+  bool contains(V* v) const { return hook(v).linked; }
+  /** Return the oldest value without removing it, NULL if the LRU is empty.
+   */
+  V* peekOldest() const { return oldest; }
   /** Remove and return the oldest value, if one exists.
 
       @return the value if the LRU is not empty, NULL otherwise.
   */
   V* removeOldest() {
-    auto it = fromSequence.begin();
-    if (it == fromSequence.end()) {
-      return NULL;
+    V* result = oldest;
+    if (result) {
+      unlink(result);
     }
-    V* result = it->second;
-    toSequence.erase(it->second);
-    fromSequence.erase(it->first);
     return result;
   }
+  /** Number of values in the LRU. */
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  /** Remove all the values. */
+  void clear() {
+    while (oldest) {
+      unlink(oldest);
+    }
+  }
 };
@@ -0,0 +1,153 @@
+#include "mapped.hpp"
+#include "config.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <vector>
+
+MappedAllocator::MappedAllocator()
+    : base(NULL),
+      mappedSize(0),
+      pageSize(sysconf(_SC_PAGESIZE)),
+      capacity((size_t)64 * 1024 * 1024 * 1024),
+      directory("/tmp") {}
+
+MappedAllocator::~MappedAllocator() {
+  if (base) {
+    munmap(base, mappedSize);
+  }
+}
+
+void MappedAllocator::map() {
+  std::string pattern = std::string(directory) + "/toyrt_mapped_XXXXXX";
+  std::vector<char> name(pattern.begin(), pattern.end());
+  name.push_back('\0');
+  int fd = mkstemp(name.data());
+  assert(fd >= 0);
+  // The file lives as long as the mapping.
+  unlink(name.data());
+  mappedSize = (capacity + pageSize - 1) / pageSize * pageSize;
+  int ierr = ftruncate(fd, mappedSize);
+  assert(!ierr);
+  void* ptr = mmap(NULL, mappedSize, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_NORESERVE, fd, 0);
+  assert(ptr != MAP_FAILED);
+  close(fd);
+  base = (char*)ptr;
+  freeRanges[0] = mappedSize;
+}
+
+void* MappedAllocator::allocate(size_t size) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!base) {
+    map();
+  }
+  size = (std::max(size, (size_t)1) + pageSize - 1) / pageSize * pageSize;
+  // First fit
+  for (auto it = freeRanges.begin(); it != freeRanges.end(); ++it) {
+    if (it->second < size) {
+      continue;
+    }
+    const size_t offset = it->first;
+    const size_t remaining = it->second - size;
+    freeRanges.erase(it);
+    if (remaining) {
+      freeRanges[offset + size] = remaining;
+    }
+    return base + offset;
+  }
+  assert(false && "MappedAllocator::capacity exceeded");
+  return NULL;
+}
+
+void MappedAllocator::free(void* ptr, size_t size) {
+  if (!ptr) {
+    return;
+  }
+  size = (std::max(size, (size_t)1) + pageSize - 1) / pageSize * pageSize;
+  // Drop the pages and their blocks in the file, so that the range reads as
+  // zeros when it is reused. Not all the file systems support it.
+  if (madvise(ptr, size, MADV_REMOVE) != 0) {
+    memset(ptr, 0, size);
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  size_t offset = (char*)ptr - base;
+  auto next = freeRanges.lower_bound(offset);
+  if (next != freeRanges.end() && next->first == offset + size) {
+    size += next->second;
+    next = freeRanges.erase(next);
+  }
+  if (next != freeRanges.begin()) {
+    auto prev = std::prev(next);
+    if (prev->first + prev->second == offset) {
+      prev->second += size;
+      return;
+    }
+  }
+  freeRanges[offset] = size;
+}
+
+MappedData::MappedData(size_t size) : Data(), payloadSize(size) {
+  payload = MappedAllocator::getInstance().allocate(size);
+}
+
+MappedData::~MappedData() {
+  MappedAllocator::getInstance().free(payload, payloadSize);
+}
+
+ssize_t MappedData::pack(void** ptr) {
+  if (ptr) {
+    *ptr = malloc(payloadSize);
+    assert(*ptr || !payloadSize);
+    memcpy(*ptr, payload, payloadSize);
+  }
+  return payloadSize;
+}
+
+void MappedData::unpack(void* ptr, ssize_t count) {
+  assert(count == (ssize_t)payloadSize);
+  memcpy(payload, ptr, count);
+}
+
+void MappedData::packRange(void* ptr, size_t offset, size_t count) {
+  assert(offset + count <= payloadSize);
+  memcpy(ptr, (char*)payload + offset, count);
+}
+
+void MappedData::unpackRange(const void* ptr, size_t offset, size_t count) {
+  assert(offset + count <= payloadSize);
+  memcpy((char*)payload + offset, ptr, count);
+}
+
+void MappedData::deallocate() {
+  const size_t pageSize = MappedAllocator::getInstance().getPageSize();
+  const size_t size = (payloadSize + pageSize - 1) / pageSize * pageSize;
+#ifdef MADV_PAGEOUT
+  // Reclaims the pages now, writing them back if needed.
+  if (madvise(payload, size, MADV_PAGEOUT) == 0) {
+    return;
+  }
+#endif
+  // For a shared mapping, the content stays in the page cache and the file.
+  int ierr = madvise(payload, size, MADV_DONTNEED);
+  assert(!ierr);
+}
+
+void MappedData::sync() {
+  int ierr = msync(payload, payloadSize, MS_SYNC);
+  assert(!ierr);
+}
+
+void MappedData::willNeed() {
+  int ierr = madvise(payload, payloadSize, MADV_WILLNEED);
+  assert(!ierr);
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include <cstddef>
+#include <map>
+#include <mutex>
+
+#include "data.hpp"
+
+/** Allocator of memory in a memory-mapped backing file.
+
+    The file is a sparse temporary file mapped once with MAP_SHARED, so that
+    the kernel can page the allocations in and out of it. The allocations are
+    page aligned, and the freed ranges are given back to the file system.
+ */
+class MappedAllocator {
+ private:
+  std::mutex mutex;
+  char* base;
+  size_t mappedSize;
+  size_t pageSize;
+  /** Free ranges, offset -> size. Adjacent ranges are merged. */
+  std::map<size_t, size_t> freeRanges;
+
+  void map();
+
+ public:
+  /** Size of the backing file, 64 GB by default. Must be set before the first
+      allocation.
+   */
+  size_t capacity;
+  /** Directory of the backing file, /tmp by default. */
+  const char* directory;
+
+  /** Allocate a page aligned range of the mapping, filled with zeros. */
+  void* allocate(size_t size);
+  void free(void* ptr, size_t size);
+  size_t getPageSize() const { return pageSize; }
+  static MappedAllocator& getInstance() {
+    static MappedAllocator allocator;
+    return allocator;
+  }
+
+ private:
+  MappedAllocator();
+  MappedAllocator(const MappedAllocator&) = delete;
+  ~MappedAllocator();
+};
+
+/** Data whose payload lives in the memory-mapped file of MappedAllocator.
+
+    Such data are not packed and written by the IO thread: swapping them out
+    is an msync() of the payload if it is dirty followed by an
+    madvise(MADV_PAGEOUT) (MADV_DONTNEED on older kernels), and prefetching them
+    is an madvise(MADV_WILLNEED). The payload address never changes, and the
+    usual swapped and dirty flags, and the eviction policy, drive these calls.
+ */
+class MappedData : public Data {
+ protected:
+  /** Payload, in the mapped file. */
+  void* payload;
+  size_t payloadSize;
+
+ public:
+  /** Constructor.
+
+      @param size payload size in bytes
+   */
+  MappedData(size_t size);
+  ~MappedData();
+  ssize_t pack(void** ptr) override;
+  void unpack(void* ptr, ssize_t count) override;
+  bool packsByRange() override { return true; }
+  void packRange(void* ptr, size_t offset, size_t count) override;
+  void unpackRange(const void* ptr, size_t offset, size_t count) override;
+  /** Release the pages of the payload, without losing their content. */
+  void deallocate() override;
+  size_t size() override { return payloadSize; }
+  /** Write the payload back to the file. */
+  void sync();
+  /** Ask the kernel to read the payload back in the background. */
+  void willNeed();
+};
@@ -0,0 +1,60 @@
+#include "memory_manager.hpp"
+
+#include <limits>
+
+#include "dependencies.hpp"
+
+size_t MemoryManager::watermark(double fraction) {
+  const size_t maxMemorySize = TaskScheduler::getInstance().maxMemorySize;
+  if (maxMemorySize == std::numeric_limits<size_t>::max()) {
+    return maxMemorySize;
+  }
+  return (size_t)(fraction * maxMemorySize);
+}
+
+void MemoryManager::notify() {
+  if (TaskScheduler::getInstance().dataSize <= watermark(highWatermark)) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  evictionRequested = true;
+  wakeup.notify_one();
+}
+
+void MemoryManager::mainLoop() {
+  myId = std::this_thread::get_id();
+  {
+    DECLARE_CONTEXT;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      if (!evictionRequested) {
+        if (stopRequested) {
+          break;
+        }
+        wakeup.wait(lock);
+        continue;
+      }
+      evictionRequested = false;
+      lock.unlock();
+      TaskScheduler::getInstance().evict(watermark(lowWatermark));
+      passes++;
+      lock.lock();
+    }
+    stopRequested = false;
+  }
+  myId = static_cast<std::thread::id>(0);
+}
+
+void MemoryManager::pleaseStop() {
+  std::lock_guard<std::mutex> lock(mutex);
+  stopRequested = true;
+  wakeup.notify_one();
+}
+
+MemoryManager::MemoryManager()
+    : evictionRequested(false),
+      stopRequested(false),
+      passes(0),
+      highWatermark(1.),
+      lowWatermark(0.9) {}
@@ -0,0 +1,57 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+
+/** Background eviction thread.
+
+    The completion of the tasks only checks the memory consumption against the
+    high-water mark, and wakes this thread up when it is exceeded. The thread
+    then evicts data (see TaskScheduler::evict()) until the memory consumption
+    gets below the low-water mark, while the workers keep running tasks.
+
+    Both marks are fractions of TaskScheduler::maxMemorySize.
+ */
+class MemoryManager {
+ private:
+  /** Protects \a evictionRequested and \a stopRequested. */
+  std::mutex mutex;
+  /** Used to sleep until the high-water mark is exceeded. */
+  std::condition_variable wakeup;
+  bool evictionRequested;
+  bool stopRequested;
+  /** Number of eviction passes. */
+  std::atomic<size_t> passes;
+
+ public:
+  /** Memory consumption waking the thread up. Defaults to 1. */
+  double highWatermark;
+  /** Memory consumption the eviction goes down to. Defaults to 0.9. */
+  double lowWatermark;
+  // thread id of the memory manager thread
+  std::thread::id myId;
+
+  /** Wake the thread up if the memory consumption is above the high-water
+      mark.
+
+      This is cheap when it is not, and can be called from any thread.
+   */
+  void notify();
+  void mainLoop();
+  void pleaseStop();
+  /** Number of eviction passes done so far. */
+  size_t evictionPasses() const { return passes; }
+  static MemoryManager& getInstance() {
+    static MemoryManager mm;
+    return mm;
+  }
+
+ private:
+  /** Size in bytes corresponding to a fraction of maxMemorySize. */
+  static size_t watermark(double fraction);
+  MemoryManager();
+  MemoryManager(const MemoryManager&) = delete;
+  ~MemoryManager() = default;
+};
@@ -1,6 +1,12 @@
 #include "config.h"
 
 #include <mpi.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <limits>
 #include <list>
 #include <mutex>
 
@@ -20,221 +26,1053 @@ class DeallocateDataTask : public Task {
   DeallocateDataTask(Data* d) : Task("Deallocate"), d(d) { isCallback = true; }
   void call() { d->deallocate(); }
 };
+
+/** Tag of the aggregated messages. The data tags are never 0. */
+const int kBatchTag = 0;
+
+/** Header of a packed data in a batch, followed by the data. */
+struct PartHeader {
+  int tag;
+  int count;
+};
+
+/** Messages of the stealing protocol. */
+enum StealMessage {
+  STEAL_REQUEST,  ///< Ask for a task
+  STEAL_TASK,     ///< A task and all its parameters
+  STEAL_NONE,     ///< No task to give
+  STEAL_RESULT,   ///< The parameters written by a stolen task
+  STEAL_DONE,     ///< The sender has no tasks left
+  STEAL_FINAL     ///< The sender knows that all the ranks are done
+};
+
+/** Header of the messages of the stealing protocol. */
+struct StealHeader {
+  int type;
+  int id;  ///< Task::stealId of the task for STEAL_TASK and STEAL_RESULT
+};
+
+/** Append the size of a packed data, and the data, to a message. */
+void appendPacked(std::vector<char>& message, Data* d) {
+  void* ptr = NULL;
+  const int64_t count = d->pack(&ptr);
+  const char* header = (const char*)&count;
+  message.insert(message.end(), header, header + sizeof(count));
+  message.insert(message.end(), (char*)ptr, (char*)ptr + count);
+  free(ptr);
+}
+
+/** Unpack a data appended by appendPacked().
+
+    @return the position of the next one
+ */
+char* unpackNext(char* ptr, Data* d) {
+  int64_t count;
+  memcpy(&count, ptr, sizeof(count));
+  ptr += sizeof(count);
+  d->unpack(ptr, count);
+  return ptr + count;
+}
 }  // namespace
 
-MpiDataCache::iterator_t MpiDataCache::find(Data* d) {
-  iterator_t it = validOnNode.find(d);
-  if (it == validOnNode.end()) {
-    auto tmp = std::vector<bool>(size, false);
+HolderSet& MpiDataCache::holders(Data* d) {
+  if (d->holders.size() == 0) {
     // The data is always valid on its parent node
-    tmp[d->rank] = true;
-    validOnNode[d] = tmp;
-    it = validOnNode.find(d);
+    d->holders.insert(d->rank, 0);
   }
-  return it;
+  return d->holders;
 }
 
-MpiDataCache::MpiDataCache() : validOnNode(), enabled(true) {
+MpiDataCache::MpiDataCache()
+    : shared(),
+      enabled(true),
+      capacity(std::numeric_limits<size_t>::max()),
+      hits(0),
+      misses(0),
+      evictions(0) {
   rank = TaskScheduler::getInstance().getMpiRank();
   size = TaskScheduler::getInstance().getMpiSize();
+  remote.resize(size);
+  for (RemoteCopies& r : remote) {
+    r.size = 0;
+  }
+}
+
+void MpiDataCache::addCopy(Data* d, int node) {
+  RemoteCopies& r = remote[node];
+  const size_t dataSize = d->size();
+  r.lru.push_back(std::make_pair(d, dataSize));
+  r.index[d] = std::prev(r.lru.end());
+  r.size += dataSize;
+}
+
+void MpiDataCache::removeCopy(Data* d, int node) {
+  RemoteCopies& r = remote[node];
+  auto it = r.index.find(d);
+  if (it == r.index.end()) {
+    return;
+  }
+  r.size -= it->second->second;
+  r.lru.erase(it->second);
+  r.index.erase(it);
 }
 
 void MpiDataCache::eraseData(Data* d) {
-  iterator_t it = validOnNode.find(d);
-  if (it != validOnNode.end()) {
-    validOnNode.erase(it);
+  for (const auto& h : d->holders) {
+    removeCopy(d, h.rank);
   }
+  d->holders.clear();
+  shared.erase(d);
 }
 
 void MpiDataCache::sendData(Data* d, int from, int to) {
-  (void)from;
-  auto it = find(d);
-  assert(it->second[from]);  // Check that the data is valid on 'from'
-  it->second[to] = true;     // Mark the data as valid on 'to'
+  HolderSet& h = holders(d);
+  assert(h.contains(from));  // Check that the data is valid on 'from'
+  if (!h.contains(to)) {
+    // Mark the data as valid on 'to'
+    const int round = ++h.value(from);
+    h.insert(to, round);
+    if (to != d->rank) {
+      addCopy(d, to);
+      shared.insert(d);
+    }
+  }
+}
+
+bool MpiDataCache::use(Data* d, int node) {
+  if (d->rank == node) {
+    return true;
+  }
+  if (!isValidOnNode(d, node)) {
+    misses++;
+    return false;
+  }
+  hits++;
+  RemoteCopies& r = remote[node];
+  auto it = r.index.find(d);
+  if (it != r.index.end()) {
+    r.lru.splice(r.lru.end(), r.lru, it->second);
+  }
+  return true;
+}
+
+void MpiDataCache::shrink(int node, const toyRT_DepsArray& keep) {
+  RemoteCopies& r = remote[node];
+  auto it = r.lru.begin();
+  while ((r.size > capacity) && (it != r.lru.end())) {
+    Data* d = it->first;
+    ++it;
+    if (std::find_if(keep.begin(), keep.end(),
+                     [d](const std::pair<const void*, toyRT_AccessMode>& p) {
+                       return p.first == d;
+                     }) != keep.end()) {
+      continue;
+    }
+    if (node == rank) {
+      TaskScheduler::getInstance().insertTask(
+          new DeallocateDataTask(d), {{d, toyRT_WRITE}}, Priority::HIGH);
+    }
+    d->holders.erase(node);
+    if (d->holders.size() == 1) {
+      shared.erase(d);
+    }
+    removeCopy(d, node);
+    evictions++;
+  }
+}
+
+int MpiDataCache::findSource(Data* d) {
+  HolderSet& h = holders(d);
+  int source = d->rank;
+  int round = h.value(source);
+  for (const auto& holder : h) {
+    // The owner, then the lowest rank among ties
+    if ((holder.value < round) ||
+        ((holder.value == round) && (source != d->rank) &&
+         (holder.rank < source))) {
+      source = holder.rank;
+      round = holder.value;
+    }
+  }
+  return source;
 }
 
 void MpiDataCache::invalidateData(Data* d, int exceptOnNode) {
-  auto it = find(d);
-  if (it->second[rank] && (rank != d->rank) && (rank != exceptOnNode)) {
+  HolderSet& h = holders(d);
+  if (h.contains(rank) && (rank != d->rank) && (rank != exceptOnNode)) {
     TaskScheduler::getInstance().insertTask(new DeallocateDataTask(d),
                                             {{d, toyRT_WRITE}}, Priority::HIGH);
   }
-  bool tmp;
-  if (exceptOnNode != -1) {
-    tmp = it->second[exceptOnNode];
+  const bool keep = (exceptOnNode != -1) && (exceptOnNode != d->rank) &&
+                    h.contains(exceptOnNode);
+  for (const auto& holder : h) {
+    if (holder.rank != exceptOnNode) {
+      removeCopy(d, holder.rank);
+    }
   }
-  it->second.assign(size, false);
-  it->second[d->rank] = true;
-  if (exceptOnNode != -1) {
-    it->second[exceptOnNode] = tmp;
+  // The rounds start over.
+  h.clear();
+  h.insert(d->rank, 0);
+  if (keep) {
+    h.insert(exceptOnNode, 0);
+  } else {
+    shared.erase(d);
   }
 }
 
 void MpiDataCache::invalidateAll() {
-  for (auto p : validOnNode) {
-    invalidateData((Data*)p.first);
+  std::vector<Data*> data(shared.begin(), shared.end());
+  for (Data* d : data) {
+    invalidateData(d);
   }
 }
 
 bool MpiDataCache::isValid(Data* d) { return isValidOnNode(d, rank); }
 
 bool MpiDataCache::isValidOnNode(Data* d, int node) {
-  auto it = find(d);
-  return it->second[node];
+  // The owner is in the holders once the data is known.
+  return (node == d->rank) || d->holders.contains(node);
 }
 
 void MpiRequestPool::pushSend(MpiSendTask* task) {
-  std::lock_guard<std::mutex> lock(pendingMutex);
   assert(task->d->tag != 0);
+  Request* r = new Request(SEND, task);
+  if (directPosting && postSend(r)) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(pendingMutex);
   if (TaskScheduler::getInstance().verbose())
     printf("%s push %s\n",
            TaskScheduler::getInstance().getLocalization().c_str(),
            task ? task->description().c_str() : "NULL");
-  pending.push_front(new Request(SEND, task));
+  pending.push_front(r);
   sleepConditionMPI.notify_one();
 }
 
 void MpiRequestPool::pushRecv(MpiRecvTask* task) {
-  std::lock_guard<std::mutex> lock(pendingMutex);
   assert(task->d->tag != 0);
+  Request* r = new Request(RECV, task);
+  if (directPosting && postRecv(r)) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(pendingMutex);
   if (TaskScheduler::getInstance().verbose())
     printf("%s push %s\n",
            TaskScheduler::getInstance().getLocalization().c_str(),
            task ? task->description().c_str() : "NULL");
-  pending.push_front(new Request(RECV, task));
+  pending.push_front(r);
+  sleepConditionMPI.notify_one();
+}
+
+bool MpiRequestPool::postSend(Request* r) {
+  // The throttled sends go first.
+  if ((choosePath(r) != DIRECT) || (throttledSends > 0) || !admitSend(r)) {
+    return false;
+  }
+  // Same rule as pushDetachedRequest(), and behind the waiting sends of the
+  // pair.
+  {
+    std::lock_guard<std::mutex> lock(slotMutex);
+    if ((waiting.find(RequestId(r->to, r->d->tag)) != waiting.end()) ||
+        !takeSlot(r)) {
+      return false;
+    }
+  }
+  // Two workers may both fit under the caps, and overshoot them by a message.
+  peerBytesInFlight[r->to] += r->count;
+  bytesInFlight += r->count;
+  ssize_t count = r->d->pack(&r->ptr);
+  (void)count;
+  assert(count == (ssize_t)r->count);
+  REGISTER_ALLOC(r->ptr, r->count);
+  MPI_Request request;
+  int ierr = MPI_Issend(r->ptr, (int)r->count, MPI_BYTE, r->to, r->d->tag,
+                        TaskScheduler::getInstance().getMpiComm(), &request);
+  assert(!ierr);
+  // Before the MPI thread can see the request.
+  releaseSender(r);
+  std::lock_guard<std::mutex> lock(pendingMutex);
+  posted.push_back(std::make_pair(r, request));
+  sleepConditionMPI.notify_one();
+  return true;
+}
+
+bool MpiRequestPool::postRecv(Request* r) {
+  // The receives of a (from, tag) pair are ordered by the dependencies, so no
+  // other one is matching this pair. A pair whose sends are batched has no
+  // message of its own, and is left to the MPI thread.
+  if (r->d->packsByRange()) {
+    return false;
+  }
+  MPI_Message message;
+  MPI_Status status;
+  int flag;
+  MPI_Comm comm = TaskScheduler::getInstance().getMpiComm();
+  int ierr = MPI_Improbe(r->from, r->d->tag, comm, &flag, &message, &status);
+  assert(!ierr);
+  if (!flag) {
+    return false;
+  }
+  int count;
+  MPI_Get_count(&status, MPI_BYTE, &count);
+  r->count = count;
+  r->ptr = buffers.acquire(r->count);
+  MPI_Request request;
+  ierr = MPI_Imrecv(r->ptr, count, MPI_BYTE, &message, &request);
+  assert(!ierr);
+  std::lock_guard<std::mutex> lock(pendingMutex);
+  posted.push_back(std::make_pair(r, request));
+  sleepConditionMPI.notify_one();
+  return true;
+}
+
+void MpiRequestPool::adoptPosted() {
+  for (const auto& p : posted) {
+    Request* r = p.first;
+    // The slot of a send is taken by postSend().
+    if (r->type == SEND) {
+      sentData.record(r->count);
+    } else {
+      recvData.record(r->count);
+    }
+    *attach(r) = p.second;
+  }
+  posted.clear();
+}
+
+void MpiRequestPool::pushStolenResult(MpiStolenTask* task) {
+  std::lock_guard<std::mutex> lock(pendingMutex);
+  Request* r = new Request(STEAL, task->from);
+  r->task = task;
+  pending.push_front(r);
+  sleepConditionMPI.notify_one();
+}
+
+void MpiRequestPool::localTasksDone() {
+  localDone = true;
   sleepConditionMPI.notify_one();
 }
 
 void MpiRequestPool::displayDetachedRequests() const {
+  for (Request* r : unmatched) {
+    std::cout << "RECV(unmatched, fromto = " << r->from
+              << ", tag = " << r->d->tag << ")" << std::endl;
+  }
   for (Request* r : detached) {
+    if (r->type == BATCH) {
+      std::cout << "BATCH(" << r->ptr << ", " << r->count << ", to = " << r->to
+                << ", parts = " << r->parts.size() << ")" << std::endl;
+      continue;
+    }
+    if (r->type == STEAL) {
+      std::cout << "STEAL(" << r->ptr << ", " << r->count << ", to = " << r->to
+                << ")" << std::endl;
+      continue;
+    }
+    if (r->type == CHUNK) {
+      std::cout << (r->parent->type == SEND ? "SEND" : "RECV") << " CHUNK("
+                << r->ptr << ", " << r->offset << ", " << r->count
+                << ", fromto = " << r->from << ", tag = " << r->d->tag << ")"
+                << std::endl;
+      continue;
+    }
     std::cout << (r->type == SEND ? "SEND" : "RECV") << "(" << r->ptr << ", "
               << r->count << ", fromto = " << r->from << ", tag = " << r->d->tag
               << ")" << std::endl;
   }
 }
 
-std::list<MpiRequestPool::Request*>::iterator
-MpiRequestPool::processCompletedRequest(std::list<Request*>::iterator it) {
-  Request* r = *it;
+void MpiRequestPool::processCompletedRequest(Request* r) {
+  TaskScheduler& s = TaskScheduler::getInstance();
 
   switch (r->type) {
     case RECV: {
       MpiRecvTask* t = (MpiRecvTask*)r->task;
-      // 2 cases: received the size or the data.
-      if (!r->sizeReqDone) {
-        r->sizeReqDone = true;
-        assert(r->d->tag != 0);
-        recvData.record(r->count);
-        // Only the size has been received, do a new MPI_Irecv() for the data.
-        // The size is now in t->count;
-        r->ptr = calloc(1, r->count);
-        REGISTER_ALLOC(r->ptr, r->count);
-        // std::cout << "RECV(" << r->count << ", from = " << r->from
-        //           << ", tag = " << r->d->tag << ")" << std::endl;
-        int ierr =
-            MPI_Irecv(r->ptr, (int)r->count, MPI_BYTE, r->from, r->d->tag,
-                      TaskScheduler::getInstance().getMpiComm(), &r->req);
-        assert(!ierr);
-        // Don't remove the query.
-        // TODO: should we bump the iterator ? If we don't, this very query will
-        // be tested right away.
-        ++it;
-      } else {
-        assert(t->d->tag != 0);
-        // We received the data, need to unpack and free the deps.
-        r->d->unpack(r->ptr, r->count);
-        REGISTER_FREE(r->ptr, r->count);
-        free(r->ptr);
-        TaskScheduler& s = TaskScheduler::getInstance();
-        s.postTaskExecution(t);
-        it = detached.erase(it);
-        delete r;
-      }
+      assert(t->d->tag != 0);
+      // We received the data, need to unpack and free the deps.
+      r->d->unpack(r->ptr, r->count);
+      buffers.release(r->ptr, r->count);
+      s.postTaskExecution(t);
+      delete r;
     } break;
     case SEND: {
-      MpiSendTask* t = (MpiSendTask*)r->task;
-      if (!r->sizeReqDone) {
-        r->sizeReqDone = true;
-        ssize_t count = r->d->pack(&r->ptr);
-        (void)count;
-        assert(count == r->count);
-        REGISTER_ALLOC(r->ptr, r->count);
-        sentData.record(r->count);
-        int ierr =
-            MPI_Isend(r->ptr, (int)r->count, MPI_BYTE, r->to, r->d->tag,
-                      TaskScheduler::getInstance().getMpiComm(), &r->req);
-        assert(!ierr);
-        ++it;
-      } else {
+      // Aggregated sends have already been copied to their batch.
+      if (r->ptr) {
         REGISTER_FREE(r->ptr, r->count);
         free(r->ptr);
-        TaskScheduler& s = TaskScheduler::getInstance();
-        s.postTaskExecution(t);
-        it = detached.erase(it);
-        // Mark that this (to, tag) pair is now free
-        auto p = std::make_pair(r->to, r->d->tag);
-        sendsInFlight.erase(p);
-        // If there is a request waiting, process it now.
-        auto it = waiting.find(p);
-        if (it != waiting.end()) {
-          Request* r = it->second.front();  // What if r is NULL ?
-          it->second.pop_front();
-          pushDetachedRequest(r);
+      }
+      // Only the chunked sends still hold their task, see releaseSender().
+      if (r->task) {
+        s.postTaskExecution(r->task);
+      }
+      if (r->path != CHUNKED) {
+        peerBytesInFlight[r->to] -= r->count;
+        bytesInFlight -= r->count;
+      }
+      if (forced[r->to] == r) {
+        forced[r->to] = NULL;
+      }
+      lastSendDone = std::chrono::steady_clock::now();
+      auto p = std::make_pair(r->to, r->d->tag);
+      // The waiting requests that can go now take their slot before a worker
+      // can.
+      std::vector<Request*> next;
+      {
+        std::lock_guard<std::mutex> lock(slotMutex);
+        auto f = sendsInFlight.find(p);
+        if (--f->second.inFlight == 0) {
+          sendsInFlight.erase(f);
         }
-        delete r;
+        auto w = waiting.find(p);
+        while ((w != waiting.end()) && takeSlot(w->second.front())) {
+          next.push_back(w->second.front());
+          w->second.pop_front();
+          if (w->second.empty()) {
+            waiting.erase(w);
+            w = waiting.end();
+          }
+        }
+      }
+      for (Request* n : next) {
+        startSend(n);
+      }
+      delete r;
+    } break;
+    case BATCH: {
+      buffers.release(r->ptr, r->count);
+      Outbox& o = outboxes[r->to];
+      o.inFlight--;
+      for (Request* part : r->parts) {
+        processCompletedRequest(part);
+      }
+      // What piled up in the meantime goes now.
+      if (!o.parts.empty() && (o.inFlight == 0)) {
+        flush(r->to);
+      }
+      delete r;
+    } break;
+    case CHUNK: {
+      Request* parent = r->parent;
+      if (parent->type == RECV) {
+        parent->d->unpackRange(r->ptr, r->offset, r->count);
       }
+      releaseChunkBuffer(r->ptr, parent->type == SEND);
+      parent->chunksInFlight--;
+      if (parent->lastChunk && (parent->chunksInFlight == 0)) {
+        if (parent->type == RECV) {
+          s.postTaskExecution(parent->task);
+          delete parent;
+        } else {
+          processCompletedRequest(parent);
+        }
+      }
+      delete r;
+    } break;
+    case STEAL: {
+      buffers.release(r->ptr, r->count);
+      delete r;
     } break;
   }
-  return it;
 }
 
-void MpiRequestPool::testDetachedRequests() {
-  MPI_Status status;
-  auto it = detached.begin();
-  while (it != detached.end()) {
-    Request* r = *it;
+void MpiRequestPool::flush(int to) {
+  Outbox& o = outboxes[to];
+  Request* r = new Request(BATCH, to);
+  r->count = o.buffer.size();
+  r->ptr = buffers.acquire(r->count);
+  memcpy(r->ptr, o.buffer.data(), r->count);
+  r->parts.swap(o.parts);
+  o.buffer.clear();
+  o.inFlight++;
+  int ierr = MPI_Issend(r->ptr, (int)r->count, MPI_BYTE, to, kBatchTag,
+                        TaskScheduler::getInstance().getMpiComm(), attach(r));
+  assert(!ierr);
+}
+
+bool MpiRequestPool::flushOutboxes() {
+  bool flushed = false;
+  for (int to = 0; to < (int)outboxes.size(); to++) {
+    Outbox& o = outboxes[to];
+    if (!o.parts.empty() &&
+        ((o.inFlight == 0) || (o.buffer.size() >= maxBatchSize))) {
+      flush(to);
+      flushed = true;
+    }
+  }
+  return flushed;
+}
+
+void MpiRequestPool::deliver(Request* r, const void* ptr, size_t count) {
+  assert(r->d->tag != 0);
+  r->count = count;
+  recvData.record(count);
+  r->d->unpack(const_cast<void*>(ptr), count);
+  TaskScheduler::getInstance().postTaskExecution(r->task);
+  delete r;
+}
+
+bool MpiRequestPool::receiveBatches() {
+  bool received = false;
+  // The batches are received even if nothing is to be delivered yet, their
+  // synchronous sends only complete then.
+  MPI_Comm comm = TaskScheduler::getInstance().getMpiComm();
+  while (true) {
+    MPI_Message message;
+    MPI_Status status;
+    int flag;
+    int ierr =
+        MPI_Improbe(MPI_ANY_SOURCE, kBatchTag, comm, &flag, &message, &status);
+    assert(!ierr);
+    if (!flag) {
+      break;
+    }
+    received = true;
+    int count;
+    MPI_Get_count(&status, MPI_BYTE, &count);
+    const int from = status.MPI_SOURCE;
+    char* buffer = (char*)buffers.acquire(count);
+    // Received at once, so that the batches of a source are demultiplexed in
+    // order. They are small enough to have arrived already.
+    ierr = MPI_Mrecv(buffer, count, MPI_BYTE, &message, MPI_STATUS_IGNORE);
+    assert(!ierr);
+    size_t offset = 0;
+    while (offset < (size_t)count) {
+      PartHeader h;
+      memcpy(&h, buffer + offset, sizeof(h));
+      const char* part = buffer + offset + sizeof(h);
+      offset += sizeof(h) + h.count;
+      assert(offset <= (size_t)count);
+      auto it = std::find_if(unmatched.begin(), unmatched.end(),
+                             [from, &h](Request* r) {
+                               return (r->from == from) &&
+                                      (r->d->tag == h.tag) && (r->count == 0);
+                             });
+      if (it == unmatched.end()) {
+        unexpected[std::make_pair(from, h.tag)].emplace_back(part,
+                                                             part + h.count);
+        continue;
+      }
+      Request* r = *it;
+      unmatched.erase(it);
+      deliver(r, part, h.count);
+    }
+    buffers.release(buffer, count);
+  }
+  return received;
+}
+
+MPI_Request* MpiRequestPool::attach(Request* r) {
+  detached.push_back(r);
+  requests.push_back(MPI_REQUEST_NULL);
+  return &requests.back();
+}
+
+void* MpiRequestPool::acquireChunkBuffer(bool send) {
+  assert(maxChunkBuffers >= 2);
+  // A chunk sent is only released once the peer receives it, so the sends
+  // must leave buffers to the receives, or two ranks sending to each other
+  // would wait for each other forever.
+  if (send && (sendChunkBuffers >= maxChunkBuffers / 2)) {
+    return NULL;
+  }
+  void* ptr = NULL;
+  if (!freeChunkBuffers.empty()) {
+    ptr = freeChunkBuffers.back();
+    freeChunkBuffers.pop_back();
+  } else if (chunkBuffers < maxChunkBuffers) {
+    chunkBuffers++;
+    ptr = malloc(chunkSize);
+    assert(ptr);
+    REGISTER_ALLOC(ptr, chunkSize);
+  }
+  if (ptr && send) {
+    sendChunkBuffers++;
+  }
+  return ptr;
+}
+
+void MpiRequestPool::releaseChunkBuffer(void* ptr, bool send) {
+  if (send) {
+    sendChunkBuffers--;
+  }
+  freeChunkBuffers.push_back(ptr);
+}
+
+bool MpiRequestPool::sendChunks() {
+  bool progress = false;
+  MPI_Comm comm = TaskScheduler::getInstance().getMpiComm();
+  while (!chunkedSends.empty()) {
+    Request* r = chunkedSends.front();
+    while (!r->lastChunk) {
+      void* ptr = acquireChunkBuffer(true);
+      if (!ptr) {
+        return progress;
+      }
+      const size_t count = std::min(chunkSize, r->count - r->offset);
+      if (count) {
+        r->d->packRange(ptr, r->offset, count);
+      }
+      Request* c = new Request(r, ptr, r->offset, count);
+      r->offset += count;
+      r->lastChunk = (count < chunkSize);
+      r->chunksInFlight++;
+      int ierr = MPI_Issend(ptr, (int)count, MPI_BYTE, r->to, r->d->tag, comm,
+                            attach(c));
+      assert(!ierr);
+      progress = true;
+    }
+    chunkedSends.pop_front();
+  }
+  return progress;
+}
+
+bool MpiRequestPool::receiveChunks(Request* r) {
+  bool progress = false;
+  MPI_Comm comm = TaskScheduler::getInstance().getMpiComm();
+  while (!r->lastChunk) {
+    void* ptr = acquireChunkBuffer(false);
+    if (!ptr) {
+      break;
+    }
+    MPI_Message message;
+    MPI_Status status;
+    int flag;
+    int ierr = MPI_Improbe(r->from, r->d->tag, comm, &flag, &message, &status);
+    assert(!ierr);
+    if (!flag) {
+      releaseChunkBuffer(ptr, false);
+      break;
+    }
+    int count;
+    MPI_Get_count(&status, MPI_BYTE, &count);
+    assert((size_t)count <= chunkSize);
+    recvData.record(count);
+    Request* c = new Request(r, ptr, r->count, count);
+    r->count += count;
+    r->lastChunk = ((size_t)count < chunkSize);
+    r->chunksInFlight++;
+    ierr = MPI_Imrecv(ptr, count, MPI_BYTE, &message, attach(c));
+    assert(!ierr);
+    progress = true;
+  }
+  return progress;
+}
+
+bool MpiRequestPool::matchReceives() {
+  bool progress = false;
+  MPI_Comm comm = TaskScheduler::getInstance().getMpiComm();
+  // The requests are kept in order, so that the receives of the same (from,
+  // tag) pair match the messages in order. A pair is blocked while the chunks
+  // of an earlier receive are still coming.
+  std::set<RequestId> blocked;
+  size_t kept = 0;
+  for (size_t i = 0; i < unmatched.size(); i++) {
+    Request* r = unmatched[i];
+    const RequestId id(r->from, r->d->tag);
+    if (!blocked.empty() && (blocked.find(id) != blocked.end())) {
+      unmatched[kept++] = r;
+      continue;
+    }
+    if (r->d->packsByRange()) {
+      progress = receiveChunks(r) || progress;
+      if (!r->lastChunk) {
+        blocked.insert(id);
+        unmatched[kept++] = r;
+      }
+      continue;
+    }
+    MPI_Message message;
+    MPI_Status status;
+    int flag;
+    int ierr = MPI_Improbe(r->from, r->d->tag, comm, &flag, &message, &status);
+    assert(!ierr);
+    if (!flag) {
+      unmatched[kept++] = r;
+      continue;
+    }
+    int count;
+    MPI_Get_count(&status, MPI_BYTE, &count);
+    r->count = count;
+    recvData.record(r->count);
+    r->ptr = buffers.acquire(r->count);
+    ierr = MPI_Imrecv(r->ptr, count, MPI_BYTE, &message, attach(r));
+    assert(!ierr);
+    progress = true;
+  }
+  unmatched.resize(kept);
+  return progress;
+}
+
+void MpiRequestPool::sendSteal(int to, int type, int id,
+                               const std::vector<char>& payload) {
+  StealHeader h = {type, id};
+  Request* r = new Request(STEAL, to);
+  r->count = sizeof(h) + payload.size();
+  r->ptr = buffers.acquire(r->count);
+  memcpy(r->ptr, &h, sizeof(h));
+  if (!payload.empty()) {
+    memcpy((char*)r->ptr + sizeof(h), payload.data(), payload.size());
+  }
+  sentData.record(r->count);
+  int ierr =
+      MPI_Isend(r->ptr, (int)r->count, MPI_BYTE, to, 0, stealComm, attach(r));
+  assert(!ierr);
+}
+
+bool MpiRequestPool::progressStealing() {
+  TaskScheduler& s = TaskScheduler::getInstance();
+  bool progress = false;
+  const std::vector<char> empty;
+  if (localDone && !doneSent) {
+    doneSent = true;
+    doneRanks++;
+    rankDone[rank] = true;
+    for (int to = 0; to < size; to++) {
+      if (to != rank) {
+        sendSteal(to, STEAL_DONE, -1, empty);
+      }
+    }
+    progress = true;
+  }
+  while (true) {
+    MPI_Message message;
+    MPI_Status status;
     int flag;
-    int ierr = MPI_Test(&r->req, &flag, &status);
+    int ierr =
+        MPI_Improbe(MPI_ANY_SOURCE, 0, stealComm, &flag, &message, &status);
+    assert(!ierr);
+    if (!flag) {
+      break;
+    }
+    int count;
+    MPI_Get_count(&status, MPI_BYTE, &count);
+    const int from = status.MPI_SOURCE;
+    std::vector<char> buffer(count);
+    ierr = MPI_Mrecv(buffer.data(), count, MPI_BYTE, &message,
+                     MPI_STATUS_IGNORE);
     assert(!ierr);
-    // Request has completed
-    if (flag) {
-      it = processCompletedRequest(it);
+    recvData.record(count);
+    StealHeader h;
+    assert((size_t)count >= sizeof(h));
+    memcpy(&h, buffer.data(), sizeof(h));
+    char* ptr = buffer.data() + sizeof(h);
+    switch (h.type) {
+      case STEAL_REQUEST: {
+        int id = -1;
+        Task* t = (doneSent ? NULL : s.stealReadyTask(from, id));
+        if (!t) {
+          sendSteal(from, STEAL_NONE, -1, empty);
+          break;
+        }
+        std::vector<char> payload;
+        for (const auto& p : t->parameters()) {
+          appendPacked(payload, (Data*)p.first);
+        }
+        stolen[id] = t;
+        sendSteal(from, STEAL_TASK, id, payload);
+        progress = true;
+      } break;
+      case STEAL_TASK: {
+        Task* t = s.stolenTask(h.id);
+        for (const auto& p : t->parameters()) {
+          ptr = unpackNext(ptr, (Data*)p.first);
+        }
+        // stealPending until the result is sent.
+        s.pushStolenTask(new MpiStolenTask(t, from, h.id));
+        progress = true;
+      } break;
+      case STEAL_NONE:
+        // Not a progress, so that the idle ranks poll slowly.
+        stealPending = false;
+        nextSteal = std::chrono::steady_clock::now() + stealInterval;
+        break;
+      case STEAL_RESULT: {
+        auto it = stolen.find(h.id);
+        assert(it != stolen.end());
+        Task* t = it->second;
+        stolen.erase(it);
+        for (const auto& p : t->parameters()) {
+          if (p.second == toyRT_WRITE) {
+            ptr = unpackNext(ptr, (Data*)p.first);
+          }
+        }
+        s.postTaskExecution(t);
+        progress = true;
+      } break;
+      case STEAL_DONE:
+        doneRanks++;
+        rankDone[from] = true;
+        progress = true;
+        break;
+      case STEAL_FINAL:
+        finalRanks++;
+        progress = true;
+        break;
+      default:
+        assert(false);
+    }
+  }
+  if ((doneRanks == size) && !finalSent) {
+    // No more requests from us after this.
+    finalSent = true;
+    for (int to = 0; to < size; to++) {
+      if (to != rank) {
+        sendSteal(to, STEAL_FINAL, -1, empty);
+      }
+    }
+    progress = true;
+  }
+  if (finalSent && (finalRanks == size - 1) && !stealPending) {
+    // The other ranks sent all their requests before FINAL, so they have all
+    // been answered.
+    assert(stolen.empty());
+    stealActive = false;
+    s.stealingDone();
+    return true;
+  }
+  if (!finalSent && !stealPending && (s.readyTaskCount() == 0) &&
+      (std::chrono::steady_clock::now() >= nextSteal)) {
+    for (int i = 0; i < size; i++) {
+      const int victim = nextVictim;
+      nextVictim = (nextVictim + 1) % size;
+      if ((victim != rank) && !rankDone[victim]) {
+        sendSteal(victim, STEAL_REQUEST, -1, empty);
+        stealPending = true;
+        break;
+      }
+    }
+  }
+  return progress;
+}
+
+bool MpiRequestPool::testDetachedRequests() {
+  bool progress = flushOutboxes();
+  if (stealActive) {
+    progress = progressStealing() || progress;
+  }
+  progress = receiveBatches() || progress;
+  progress = matchReceives() || progress;
+
+  if (!requests.empty()) {
+    completedIndices.resize(requests.size());
+    int outcount;
+    int ierr = MPI_Testsome(requests.size(), requests.data(), &outcount,
+                            completedIndices.data(), MPI_STATUSES_IGNORE);
+    assert(!ierr);
+    if (outcount == MPI_UNDEFINED) {
+      outcount = 0;
+    }
+    // Remove the completed requests from the highest index down, replacing
+    // each one by the last request, which is then known not to be completed.
+    std::sort(completedIndices.begin(), completedIndices.begin() + outcount,
+              std::greater<int>());
+    for (int i = 0; i < outcount; i++) {
+      const int index = completedIndices[i];
+      Request* r = detached[index];
+      detached[index] = detached.back();
+      requests[index] = requests.back();
+      detached.pop_back();
+      requests.pop_back();
+      processCompletedRequest(r);
+    }
+    progress = progress || (outcount > 0);
+  }
+  // Last, so that the buffers and bytes released above are reused at once.
+  progress = issueThrottled() || progress;
+  progress = sendChunks() || progress;
+  return progress;
+}
+
+MpiRequestPool::SendPath MpiRequestPool::choosePath(Request* r) const {
+  // The receiver expects chunks exactly when the data packs by ranges, unless
+  // it finds the data in a batch.
+  if ((aggregationThreshold > 0) && (r->count <= aggregationThreshold)) {
+    return BATCHED;
+  }
+  return r->d->packsByRange() ? CHUNKED : DIRECT;
+}
+
+bool MpiRequestPool::takeSlot(Request* r) {
+  r->path = choosePath(r);
+  auto p = std::make_pair(r->to, r->d->tag);
+  auto f = sendsInFlight.find(p);
+  if (f == sendsInFlight.end()) {
+    sendsInFlight[p] = (PairSends){1, r->path};
+    return true;
+  }
+  // Another path only once the earlier sends of the pair are received.
+  if ((f->second.inFlight >= maxSendsInFlight) || (f->second.path != r->path)) {
+    return false;
+  }
+  f->second.inFlight++;
+  return true;
+}
+
+bool MpiRequestPool::admitSend(Request* r) const {
+  // A send alone in flight is always admitted, so that the data larger than
+  // the caps still go.
+  const size_t peer = peerBytesInFlight[r->to];
+  return ((peer == 0) || (peer + r->count <= maxPeerBytesInFlight)) &&
+         ((bytesInFlight == 0) ||
+          (bytesInFlight + r->count <= maxBytesInFlight));
+}
+
+void MpiRequestPool::issueSend(Request* r) {
+  const SendPath path = r->path;
+  if (path == CHUNKED) {
+    // Issued by sendChunks(), with buffers of the chunk pool
+    chunkedSends.push_back(r);
+    return;
+  }
+  peerBytesInFlight[r->to] += r->count;
+  bytesInFlight += r->count;
+  if (path == BATCHED) {
+    Outbox& o = outboxes[r->to];
+    PartHeader h = {r->d->tag, (int)r->count};
+    const char* header = (const char*)&h;
+    o.buffer.insert(o.buffer.end(), header, header + sizeof(h));
+    if (r->d->packsByRange()) {
+      // Packed in place, without a temporary buffer
+      const size_t offset = o.buffer.size();
+      o.buffer.resize(offset + r->count);
+      if (r->count) {
+        r->d->packRange(o.buffer.data() + offset, 0, r->count);
+      }
     } else {
-      ++it;
+      ssize_t count = r->d->pack(&r->ptr);
+      (void)count;
+      assert(count == (ssize_t)r->count);
+      o.buffer.insert(o.buffer.end(), (char*)r->ptr,
+                      (char*)r->ptr + r->count);
+      free(r->ptr);
+      r->ptr = NULL;
+    }
+    o.parts.push_back(r);
+    if (o.buffer.size() >= maxBatchSize) {
+      flush(r->to);
     }
+    releaseSender(r);
+    return;
   }
+  ssize_t count = r->d->pack(&r->ptr);
+  (void)count;
+  assert(count == (ssize_t)r->count);
+  REGISTER_ALLOC(r->ptr, r->count);
+  int ierr = MPI_Issend(r->ptr, (int)r->count, MPI_BYTE, r->to, r->d->tag,
+                        TaskScheduler::getInstance().getMpiComm(), attach(r));
+  assert(!ierr);
+  releaseSender(r);
+}
+
+void MpiRequestPool::releaseSender(Request* r) {
+  Task* t = r->task;
+  r->task = NULL;
+  TaskScheduler::getInstance().postTaskExecution(t);
+}
+
+bool MpiRequestPool::issueThrottled() {
+  if (throttledSends == 0) {
+    return false;
+  }
+  bool progress = false;
+  // Round robin on the destinations, so that one does not take all the room.
+  for (int i = 0; i < size; i++) {
+    const int to = (nextThrottled + i) % size;
+    std::deque<Request*>& q = throttled[to];
+    while (!q.empty() && admitSend(q.front())) {
+      Request* r = q.front();
+      q.pop_front();
+      throttledSends--;
+      issueSend(r);
+      progress = true;
+    }
+  }
+  nextThrottled = (nextThrottled + 1) % size;
+  // The receive of an admitted send may wait for a throttled one, through the
+  // tasks of the receiver: let one go if no send completes for a while. A
+  // destination gets a single forced send at a time, so that a slow transfer
+  // does not let one more message past the caps every maxThrottleDelay.
+  if ((throttledSends > 0) && !progress &&
+      (std::chrono::steady_clock::now() - lastSendDone > maxThrottleDelay)) {
+    for (int i = 0; i < size; i++) {
+      const int to = (nextThrottled + i) % size;
+      std::deque<Request*>& q = throttled[to];
+      if (!q.empty() && !forced[to]) {
+        Request* r = q.front();
+        q.pop_front();
+        throttledSends--;
+        forced[to] = r;
+        forcedSends++;
+        issueSend(r);
+        lastSendDone = std::chrono::steady_clock::now();
+        progress = true;
+        break;
+      }
+    }
+  }
+  return progress;
+}
+
+void MpiRequestPool::startSend(Request* r) {
+  sentData.record(r->count);
+  // Sends over the byte caps wait unpacked, behind the earlier ones to the
+  // same destination.
+  if ((r->path != CHUNKED) && (!throttled[r->to].empty() || !admitSend(r))) {
+    throttled[r->to].push_back(r);
+    throttledSends++;
+    throttledData.record(r->count);
+    return;
+  }
+  issueSend(r);
 }
 
 void MpiRequestPool::pushDetachedRequest(Request* r) {
-  int ierr;
-  r->sizeReqDone = false;
   switch (r->type) {
     case SEND: {
       assert(r->d->tag != 0);
-      // Only permit one concurrent send to the same (to, tag) pair. Additionnal
-      // requests are put on a waiting queue.
+      // Permit maxSendsInFlight concurrent sends to the same (to, tag) pair,
+      // on the same path. Additionnal requests are put on a waiting queue.
       auto p = std::make_pair(r->to, r->d->tag);
-      if (sendsInFlight.find(p) != sendsInFlight.end()) {
-        waiting[p].push_back(r);
-      } else {
-        sendsInFlight.insert(p);
-        // std::cout << "SEND(" << r->count << ", to = " << r->to << ", tag = "
-        //           << r->d->tag << ")" << std::endl;
-        ierr =
-            MPI_Issend(&r->count, 1, MPI_UNSIGNED_LONG_LONG, r->to, r->d->tag,
-                       TaskScheduler::getInstance().getMpiComm(), &r->req);
-        assert(!ierr);
+      {
+        std::lock_guard<std::mutex> lock(slotMutex);
+        auto w = waiting.find(p);
+        if ((w != waiting.end()) || !takeSlot(r)) {
+          waiting[p].push_back(r);
+          return;
+        }
       }
+      startSend(r);
     } break;
     case RECV: {
-      // std::cout << "RECV(" << ", from = " << r->from << ", tag = "
-      //           << r->d->tag << ")" << std::endl;
-      ierr = MPI_Irecv(&r->count, 1, MPI_UNSIGNED_LONG_LONG, r->from, r->d->tag,
-                       TaskScheduler::getInstance().getMpiComm(), &r->req);
-      assert(!ierr);
+      auto it = unexpected.find(std::make_pair(r->from, r->d->tag));
+      if (it != unexpected.end()) {
+        // Already received in a batch
+        std::vector<char> part;
+        part.swap(it->second.front());
+        it->second.pop_front();
+        if (it->second.empty()) {
+          unexpected.erase(it);
+        }
+        deliver(r, part.data(), part.size());
+        break;
+      }
+      // Matched in testDetachedRequests()
+      unmatched.push_back(r);
     } break;
+    case STEAL: {
+      // The result of a stolen task
+      MpiStolenTask* t = static_cast<MpiStolenTask*>(r->task);
+      sendSteal(t->from, STEAL_RESULT, t->id, t->result);
+      delete t;
+      delete r;
+      stealPending = false;
+      nextSteal = std::chrono::steady_clock::now();
+    } break;
+    case BATCH:
+    case CHUNK:
+      assert(false);
+      break;
   }
-  detached.push_back(r);
 }
 
 void MpiRequestPool::mainLoop() {
@@ -245,17 +1083,49 @@ void MpiRequestPool::mainLoop() {
     MPI_Initialized(&initialized);
     if (!initialized) {
       int provided;
-      MPI_Init_thread(NULL, NULL, MPI_THREAD_SERIALIZED, &provided);
+      MPI_Init_thread(
+          NULL, NULL,
+          threadMultiple ? MPI_THREAD_MULTIPLE : MPI_THREAD_SERIALIZED,
+          &provided);
+    }
+    int level;
+    MPI_Query_thread(&level);
+    directPosting = threadMultiple && (level == MPI_THREAD_MULTIPLE);
+    stealActive = TaskScheduler::getInstance().stealing && (size > 1);
+    if (stealActive) {
+      MPI_Comm_dup(TaskScheduler::getInstance().getMpiComm(), &stealComm);
+      doneSent = finalSent = false;
+      doneRanks = finalRanks = 0;
+      rankDone.assign(size, false);
+      stealPending = false;
+      nextVictim = (rank + 1) % size;
+      nextSteal = std::chrono::steady_clock::now();
     }
 
     bool shouldStop = false;  // Moves to true when a NULL task is poped
     bool shouldReallyStop = shouldStop;
+    // Start of the current run of passes without progress
+    auto idleSince = std::chrono::steady_clock::now();
+    std::chrono::microseconds interval(1);
     while (!shouldReallyStop) {
       std::unique_lock<std::mutex> lock(pendingMutex);
-      bool nothingToDo = pending.empty() && detached.empty();
+      bool nothingToDo = pending.empty() && posted.empty() &&
+                         detached.empty() && unmatched.empty() &&
+                         chunkedSends.empty() &&
+                         (throttledSends == 0) && !stealActive;
       if (nothingToDo && (!shouldStop)) {
         sleepConditionMPI.wait(lock);
+      } else if (pending.empty() && posted.empty() &&
+                 (std::chrono::steady_clock::now() - idleSince > pollTime)) {
+        // Nothing moves: sleep a bit longer each time, unless new requests
+        // come in.
+        sleepConditionMPI.wait_for(lock, interval);
+        interval = std::min(interval * 2, maxPollInterval);
       }
+      adoptPosted();
+      nothingToDo = pending.empty() && detached.empty() && unmatched.empty() &&
+                    chunkedSends.empty() && (throttledSends == 0) &&
+                    !stealActive;
       shouldReallyStop = shouldStop && nothingToDo;
       while (!pending.empty()) {
         Request* r = pending.back();
@@ -272,8 +1142,19 @@ void MpiRequestPool::mainLoop() {
         lock.lock();
       }
       lock.unlock();
-      testDetachedRequests();
+      if (testDetachedRequests()) {
+        idleSince = std::chrono::steady_clock::now();
+        interval = std::chrono::microseconds(1);
+      }
     }
+    if (stealComm != MPI_COMM_NULL) {
+      MPI_Comm_free(&stealComm);
+    }
+    localDone = false;
+    directPosting = false;
+    // The sends are all done, and those of the next run choose their paths
+    // again.
+    assert(sendsInFlight.empty() && waiting.empty());
   }
   myId = static_cast<std::thread::id>(0);
 }
@@ -285,17 +1166,56 @@ void MpiRequestPool::pleaseStop() {
   sleepConditionMPI.notify_one();
 }
 
-MpiRequestPool::MpiRequestPool() {
+MpiRequestPool::MpiRequestPool()
+    : pollTime(std::chrono::microseconds(100)),
+      maxPollInterval(std::chrono::microseconds(1000)),
+      aggregationThreshold(4096),
+      maxBatchSize(64 * 1024),
+      chunkSize(1024 * 1024),
+      maxChunkBuffers(8),
+      maxSendsInFlight(8),
+      maxPeerBytesInFlight(64 * 1024 * 1024),
+      maxBytesInFlight(256 * 1024 * 1024),
+      maxThrottleDelay(std::chrono::microseconds(10000)),
+      threadMultiple(false),
+      stealInterval(std::chrono::microseconds(200)) {
   rank = TaskScheduler::getInstance().getMpiRank();
   size = TaskScheduler::getInstance().getMpiSize();
+  outboxes.resize(size);
+  for (Outbox& o : outboxes) {
+    o.inFlight = 0;
+  }
+  chunkBuffers = 0;
+  sendChunkBuffers = 0;
+  peerBytesInFlight.reset(new std::atomic<size_t>[size]);
+  for (int to = 0; to < size; to++) {
+    peerBytesInFlight[to] = 0;
+  }
+  bytesInFlight = 0;
+  throttled.resize(size);
+  throttledSends = 0;
+  nextThrottled = 0;
+  forced.assign(size, NULL);
+  forcedSends = 0;
+  lastSendDone = std::chrono::steady_clock::now();
+  stealComm = MPI_COMM_NULL;
+  stealActive = false;
+  localDone = false;
+  directPosting = false;
 }
 
 MpiRequestPool::~MpiRequestPool() {
+  for (void* ptr : freeChunkBuffers) {
+    REGISTER_FREE(ptr, chunkSize);
+    free(ptr);
+  }
   char filename[256];
   sprintf(filename, "recv-%03d.txt", rank);
   recvData.toFile(filename);
   sprintf(filename, "send-%03d.txt", rank);
   sentData.toFile(filename);
+  sprintf(filename, "throttled-%03d.txt", rank);
+  throttledData.toFile(filename);
 }
 
 void MpiSendTask::call() {
@@ -308,3 +1228,17 @@ void MpiRecvTask::call() {
   assert(d->tag != 0);
   MpiRequestPool::getInstance().pushRecv(this);
 }
+
+void MpiStolenTask::call() {
+  Task::execute(task);
+  for (const auto& p : task->parameters()) {
+    if (p.second == toyRT_WRITE) {
+      appendPacked(result, (Data*)p.first);
+    }
+  }
+  // Our instances of the data are not valid, see TaskScheduler::canSteal().
+  for (const auto& p : task->parameters()) {
+    ((Data*)p.first)->deallocate();
+  }
+  MpiRequestPool::getInstance().pushStolenResult(this);
+}
@@ -2,15 +2,21 @@
 
 #include <mpi.h>
 
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <condition_variable>
 #include <deque>
 #include <list>
 #include <map>
+#include <memory>
 #include <set>
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
+#include "buffer_pool.hpp"
 #include "context/data_recorder.hpp"
 #include "task.hpp"
 
@@ -47,31 +53,76 @@ class MpiRecvTask : public Task {
   void call();
 };
 
+/** Run a task stolen from another rank, and send the data it wrote back.
+
+    See TaskScheduler::stealing.
+ */
+class MpiStolenTask : public Task {
+ public:
+  Task* task;  ///< Copy of the stolen task
+  int from;    ///< Rank the task was stolen from
+  int id;      ///< Task::stealId of the task
+  /** The message carrying the written data back */
+  std::vector<char> result;
+
+ public:
+  MpiStolenTask(Task* task, int from, int id)
+      : Task("MpiStolen"), task(task), from(from), id(id) {
+    doPostExecution = false;
+  }
+  void call();
+};
+
 /** MPI Data cache.
 
     This class is not the cache, it is just the tracking of which data are
     present in memory, and up to date.
     It is not a singleton, even though only one instance exists at a time.
+
+    The copies of a data on the nodes that don't own it (remote copies) are
+    kept for the next tasks, within \a capacity bytes per node. Beyond that,
+    the least recently used ones are invalidated, as a later transfer costs
+    less than running out of memory. Like the rest of the tracking, this is
+    done as the tasks are inserted, in the same way on all the nodes.
  */
 class MpiDataCache {
  private:
   /** Rank in GlobalParallelSettings::getMpiComm() and size of it. */
   int rank, size;
-  /** validOnNode[data][node] */
-  std::unordered_map<Data*, std::vector<bool> > validOnNode;
-  typedef std::unordered_map<Data*, std::vector<bool> >::iterator iterator_t;
+  /** Data valid on nodes other than their owner, see invalidateAll(). The
+      nodes with a valid copy of a data are in Data::holders, with the number
+      of transfer rounds after which they are free to send it, see
+      findSource(). */
+  std::unordered_set<Data*> shared;
+  /** Remote copies of a node, from the least recently used one, with the
+      size they were accounted with. */
+  struct RemoteCopies {
+    typedef std::list<std::pair<Data*, size_t> > List;
+    List lru;
+    std::unordered_map<Data*, List::iterator> index;
+    size_t size;  ///< Total size, in bytes
+  };
+  /** Remote copies, by node */
+  std::vector<RemoteCopies> remote;
 
  public:
   bool enabled;
+  /** Maximum total size of the remote copies of each node, in bytes. Must be
+      the same on all the nodes. Defaults to unlimited. */
+  size_t capacity;
+  /** Statistics over all the nodes: number of times a task needed a data it
+      doesn't own on its node and it was already there (hits) or not
+      (misses), and number of remote copies evicted to fit in \a capacity. */
+  size_t hits, misses, evictions;
 
  public:
   /** Create the cache tracking structures.
    */
   MpiDataCache();
-  /** Remove a Data pointer from the map validOnNode
+  /** Forget about a Data.
 
       This function must be called before deallocating the Data in unregister()
-      or further call to invalidateData() might crash.
+      or further call to invalidateAll() might crash.
 
       @param d Data to remove
    */
@@ -85,6 +136,43 @@ class MpiDataCache {
       @param to destination node
    */
   void sendData(Data* d, int from, int to);
+  /** Look up some data needed by a task on a node.
+
+      Counts a hit or a miss if the node doesn't own the data, and refreshes
+      its copy in the LRU order.
+
+      @return true if the data is valid on the node
+   */
+  bool use(Data* d, int node);
+  /** Evict remote copies of a node until they fit in \a capacity.
+
+      The least recently used copies are invalidated first, inserting a task
+      to free the memory (DeallocateDataTask) if the node is this one.
+
+      @param node the node
+      @param keep data whose copies are not evicted, the parameters of the
+      task being inserted
+   */
+  void shrink(int node, const toyRT_DepsArray& keep);
+  /** Fraction of the lookups of remote data that are hits, see \a hits. */
+  double hitRate() const {
+    return (hits + misses ? (double)hits / (hits + misses) : 0.);
+  }
+  /** Choose the node sending some data to a node that lacks it.
+
+      Any node with a valid copy can forward it. Each transfer takes a round
+      of its sender, and the copy it makes is available from the next round,
+      so choosing the valid node that is free the earliest (the owner, then
+      the lowest rank, among ties) spreads the copies of data read by many nodes along a
+      binomial tree: the owner sends it O(log P) times instead of P.
+
+      This function depends on the state of the cache only, so it makes the
+      same choice on all nodes.
+
+      @param d Data to send
+      @return the sending node
+   */
+  int findSource(Data* d);
   /** Invalidate some data.
 
       Note that the data is invalid, except on two nodes:
@@ -118,7 +206,12 @@ class MpiDataCache {
   bool isValidOnNode(Data* d, int node);
 
  private:
-  iterator_t find(Data* d);
+  /** Data::holders, with the owner added if the data is not known yet. */
+  HolderSet& holders(Data* d);
+  /** Account for a new remote copy of \a d on \a node. */
+  void addCopy(Data* d, int node);
+  /** Forget a remote copy, if it is tracked. */
+  void removeCopy(Data* d, int node);
 };
 
 /** MPI request pool and thread.
@@ -126,11 +219,82 @@ class MpiDataCache {
     All the MPI requests submitted by the runtime go through this class. This is
     required with some MPI implementations, as a single thread can issue MPI
     calls at a time.
+
+    A transfer is a single message holding the packed data. The receiver finds
+    its size with MPI_Improbe(), and receives it with MPI_Imrecv() into a
+    buffer of the right size, so there is no size handshake.
+
+    The packed data not larger than \a aggregationThreshold are not sent on
+    their own but appended to the outbox of their destination, and the outbox
+    is sent as one message with the reserved tag 0, like Nagle's algorithm: at
+    once if no batch to this destination is in flight, otherwise when the
+    previous one completes or when the outbox reaches \a maxBatchSize. An
+    idle destination thus gets its messages without delay, while the bursts
+    of small messages are merged. The receiver demultiplexes the batches to
+    the matching receives, and keeps the parts that arrive before their
+    receive is posted.
+
+    With TaskScheduler::stealing, a rank whose workers have nothing to do
+    asks the other ranks for a task, in turn, waiting \a stealInterval after
+    each refusal. The rank asked gives the ready task that would wait the
+    longest if it is worth it (see TaskScheduler::stealReadyTask()), packed
+    with all its parameters in one message, and gets the written parameters
+    back in another one, which completes the task. These messages use their
+    own communicator. Since an idle rank may still steal, the ranks then only
+    leave TaskScheduler::go() once all the ranks are done: each rank tells
+    the others when it has no tasks left (DONE), and when it knows that they
+    all are (FINAL), after which it sends no more requests.
+
+    The larger data that can be packed by ranges (Data::packsByRange()) are
+    sent as a sequence of messages of \a chunkSize bytes, ended by a shorter
+    (possibly empty) one. Each chunk is packed into a buffer of a bounded pool
+    while the previous ones are on the wire, and unpacked as soon as it is
+    received, so the temporary memory is at most \a maxChunkBuffers chunks
+    whatever the size of the data. The sends hold at most half of the pool, so
+    that two ranks sending to each other can always receive.
+
+    Up to \a maxSendsInFlight sends of the same data to the same destination,
+    usually versions of a data updated repeatedly, are in flight at once. MPI
+    matches the messages of a (source, tag) pair in the order they are sent,
+    which numbers them implicitly, and the receives of a pair are posted in the
+    same order. That only holds within one path (outbox, single message or
+    chunks): a part of a batch could otherwise be delivered before an earlier
+    version still on its way as a message of its own. Each send takes its path
+    from its size and Data::packsByRange(), which the receiver also knows, and
+    waits until the sends of its pair on another path are done. The data
+    messages are synchronous (MPI_Issend()), so a send is done once the
+    receiver has matched it. A send lets the next
+    tasks accessing the data run as soon as the data is packed, so that the
+    next version can be written while the previous one is on the wire. The
+    chunked sends pack while sending, and hold the data until they complete.
+
+    The packed data in flight are bounded by \a maxPeerBytesInFlight per
+    destination and \a maxBytesInFlight in total, counted from the packing of
+    a send to its completion (the chunked sends have their own pool). The
+    sends over the caps wait unpacked, in order per destination, and go as
+    the earlier ones complete. A send is admitted when nothing else is in
+    flight, whatever its size, and, as the receive of an admitted send may
+    depend on a waiting one through the tasks of the receiver, a waiting send
+    also goes when no send completed for \a maxThrottleDelay. At most one such
+    forced send per destination is in flight, so the bytes in flight exceed
+    the caps by at most one message per destination (see forcedSendCount()).
+
+    With \a threadMultiple, MPI is used in MPI_THREAD_MULTIPLE mode, and the
+    thread running an MpiSendTask or an MpiRecvTask posts the simple transfers
+    to MPI itself, instead of handing them to the MPI thread: the sends that
+    go as a single message, fit under the caps and get a slot of their pair
+    are packed and issued with MPI_Isend(), and the receives whose message has
+    already arrived are matched and issued with MPI_Imrecv(), into a buffer
+    of the pool. Only the MPI request is handed to
+    the MPI thread, which completes it as usual. The other transfers still go
+    through the MPI thread.
 */
 class MpiRequestPool {
  private:
   /** MPI requests types */
-  enum RequestType { SEND, RECV };
+  enum RequestType { SEND, RECV, BATCH, CHUNK, STEAL };
+  /** Ways a SEND can go: in an outbox, as one message or as chunks */
+  enum SendPath { BATCHED, DIRECT, CHUNKED };
   /** MPI request caused by a task. */
   struct Request {
     RequestType type;  ///< request type
@@ -142,11 +306,52 @@ class MpiRequestPool {
       int from;
       int to;
     };
-    MPI_Request req;   ///< MPI request to test
-    bool sizeReqDone;  ///< Has the first request (size) already been done ?
+    /** For a BATCH, the SEND requests aggregated in it. */
+    std::vector<Request*> parts;
+    // Chunked transfers
+    size_t offset;       ///< For a SEND, bytes sent. For a CHUNK, its offset
+    int chunksInFlight;  ///< Number of CHUNK of this request in \a detached
+    bool lastChunk;      ///< true once the last CHUNK is issued
+    Request* parent;     ///< For a CHUNK, the SEND or RECV it is part of
+    SendPath path;       ///< For a SEND, set when it takes a slot
+
+    /** Constructor for a BATCH or a STEAL message sent to \a to. */
+    Request(RequestType type, int to)
+        : type(type),
+          task(NULL),
+          d(NULL),
+          ptr(NULL),
+          count(0),
+          to(to),
+          offset(0),
+          chunksInFlight(0),
+          lastChunk(false),
+          parent(NULL),
+          path(DIRECT) {}
+
+    /** Constructor for a CHUNK of \a parent, in the buffer \a ptr. */
+    Request(Request* parent, void* ptr, size_t offset, size_t count)
+        : type(CHUNK),
+          task(parent->task),
+          d(parent->d),
+          ptr(ptr),
+          count(count),
+          to(parent->to),
+          offset(offset),
+          chunksInFlight(0),
+          lastChunk(false),
+          parent(parent),
+          path(parent->path) {}
 
     Request(RequestType type, Task* task)
-        : type(type), task(task), ptr(NULL), req(), sizeReqDone(false) {
+        : type(type),
+          task(task),
+          ptr(NULL),
+          offset(0),
+          chunksInFlight(0),
+          lastChunk(false),
+          parent(NULL),
+          path(DIRECT) {
       switch (type) {
         case SEND: {
           MpiSendTask* t = static_cast<MpiSendTask*>(task);
@@ -160,26 +365,114 @@ class MpiRequestPool {
           count = 0;
           from = t->from;
         } break;
+        case BATCH:
+        case CHUNK:
+        case STEAL:
+          assert(false);
+          break;
       }
     }
   };
 
-  /** List of currently running requests */
-  std::list<Request*> detached;
+  /** Requests submitted to MPI. \a requests[i] is the MPI request of
+      \a detached[i], and the completed ones are replaced by the last one so
+      that both arrays stay dense. */
+  std::vector<Request*> detached;
+  std::vector<MPI_Request> requests;
+  /** RECV requests whose message has not been matched by MPI_Improbe() yet,
+      in submission order. */
+  std::vector<Request*> unmatched;
+  /** Output of MPI_Testsome() */
+  std::vector<int> completedIndices;
   /** Locks the \a pending list. */
   std::mutex pendingMutex;
   /** Used to sleep if no request is to be processed by the MPI thread. */
   std::condition_variable sleepConditionMPI;
   /** List of requests to be submitted to MPI */
   std::list<Request*> pending;
+  /** Requests posted to MPI by the workers, with their MPI request, to be
+      added to \a detached. Locked by \a pendingMutex. */
+  std::vector<std::pair<Request*, MPI_Request> > posted;
+  /** The workers post to MPI themselves, see threadMultiple */
+  std::atomic<bool> directPosting;
 
   // Tracking of the in-flight requests.  These structures are only touched by
   // the MPI thread, thus requiring no synchonization.
   typedef std::pair<int, int> RequestId;  // to, tag
-  /** Current send requests in \a detached */
-  std::set<RequestId> sendsInFlight;
-  /** Requests that are waiting for a send to complete before being issued. */
+  /** Sends of a (to, tag) pair in flight, all on the same path */
+  struct PairSends {
+    int inFlight;
+    SendPath path;
+  };
+  /** Sends in flight, by (to, tag) pair. A pair is removed once its sends
+      are done, so that the next one chooses its path again. */
+  std::map<RequestId, PairSends> sendsInFlight;
+  /** Locks \a sendsInFlight and \a waiting, that the workers update with
+      \a directPosting */
+  std::mutex slotMutex;
+  /** Requests that are waiting for a send to complete before being issued,
+      past \a maxSendsInFlight or on another path than the sends in flight
+      of their pair. */
   std::map<RequestId, std::deque<Request*> > waiting;
+  /** Bytes of the issued sends, chunked ones aside, by destination and in
+      total */
+  std::unique_ptr<std::atomic<size_t>[]> peerBytesInFlight;
+  std::atomic<size_t> bytesInFlight;
+  /** Sends over the byte caps, by destination, in order */
+  std::vector<std::deque<Request*> > throttled;
+  /** Number of requests in \a throttled */
+  std::atomic<size_t> throttledSends;
+  /** First destination tried by issueThrottled() */
+  int nextThrottled;
+  /** Date of the last completed send */
+  std::chrono::steady_clock::time_point lastSendDone;
+  /** Send forced past the caps to each destination and still in flight, or
+      NULL */
+  std::vector<Request*> forced;
+  /** Number of sends forced past the caps */
+  std::atomic<size_t> forcedSends;
+  /** Small sends to one destination, waiting to be sent as one BATCH. */
+  struct Outbox {
+    std::vector<char> buffer;     ///< Part headers and packed data
+    std::vector<Request*> parts;  ///< Requests in \a buffer
+    int inFlight;                 ///< Number of BATCH in \a detached
+  };
+  /** Outboxes, by destination rank */
+  std::vector<Outbox> outboxes;
+  /** Parts of received batches whose receive is not posted yet, by (from,
+      tag) pair. */
+  std::map<RequestId, std::deque<std::vector<char> > > unexpected;
+  /** Chunked SEND requests waiting for a buffer to issue their next chunks,
+      in submission order. */
+  std::list<Request*> chunkedSends;
+  /** Free buffers of the chunk pool */
+  std::vector<void*> freeChunkBuffers;
+  /** Number of buffers of the chunk pool, free or not */
+  int chunkBuffers;
+  /** Number of buffers of the chunk pool held by the sends */
+  int sendChunkBuffers;
+
+  // Work stealing, see TaskScheduler::stealing. Only touched by the MPI
+  // thread, except localDone.
+  /** Duplicate of the communicator, for the stealing protocol */
+  MPI_Comm stealComm;
+  /** True until the tasks of all the ranks are done */
+  bool stealActive;
+  /** Set by localTasksDone() */
+  std::atomic<bool> localDone;
+  /** DONE and FINAL sent to all the ranks */
+  bool doneSent, finalSent;
+  /** Number of ranks known to be done, and that sent FINAL */
+  int doneRanks, finalRanks;
+  std::vector<bool> rankDone;
+  /** A request is waiting for its answer, or a stolen task is running */
+  bool stealPending;
+  /** Next rank to steal from */
+  int nextVictim;
+  /** Date of the next request */
+  std::chrono::steady_clock::time_point nextSteal;
+  /** Our tasks stolen by other ranks, by Task::stealId */
+  std::unordered_map<int, Task*> stolen;
 
   /** rank and size in/of GlobalParallelSettings::getMpiComm() */
   int rank, size;
@@ -187,10 +480,50 @@ class MpiRequestPool {
   /** Record the volume of sent and received data */
   TimedDataRecorder<size_t> sentData;
   TimedDataRecorder<size_t> recvData;
+  /** Record the size of the sends that wait for room under the caps */
+  TimedDataRecorder<size_t> throttledData;
 
  public:
   /** Cache mechanism */
   MpiDataCache cache;
+  /** Buffers of the received messages, of the batches and of the stealing
+      protocol. The packed data sent as single messages come from
+      Data::pack(), and the chunks have their own pool. */
+  BufferPool buffers;
+  /** How long the MPI thread keeps polling without progress before sleeping
+      between the passes. It is a duration rather than a number of passes, as
+      a pass probes for every unmatched receive. */
+  std::chrono::microseconds pollTime;
+  /** Longest sleep between two passes without progress. The sleeps start at
+      1 us and double up to this. New requests wake the thread up. */
+  std::chrono::microseconds maxPollInterval;
+  /** Largest packed data sent through the outboxes, 0 to disable the
+      aggregation. */
+  size_t aggregationThreshold;
+  /** Size above which an outbox is sent even if a batch to the same
+      destination is in flight. */
+  size_t maxBatchSize;
+  /** Size of the chunks of the pipelined transfers. Must be the same on all
+      the ranks. */
+  size_t chunkSize;
+  /** Size of the pool of chunk buffers, shared by all the transfers. At least
+      2, the sends holding at most half of it. */
+  int maxChunkBuffers;
+  /** Sends of the same (to, tag) pair in flight at once. Each one holds its
+      packed data until it completes. */
+  int maxSendsInFlight;
+  /** Packed bytes in flight to one destination, and to all of them. */
+  size_t maxPeerBytesInFlight;
+  size_t maxBytesInFlight;
+  /** Wait without any completed send after which a throttled send goes
+      anyway, to a destination without a forced send in flight. */
+  std::chrono::microseconds maxThrottleDelay;
+  /** Use MPI_THREAD_MULTIPLE, and let the workers post the simple transfers
+      to MPI. MPI must be initialized with MPI_THREAD_MULTIPLE, or not at
+      all, otherwise the transfers all go through the MPI thread. */
+  bool threadMultiple;
+  /** Wait after a refused steal request before sending the next one. */
+  std::chrono::microseconds stealInterval;
   // thread id of the communication thread
   std::thread::id myId;
 
@@ -209,22 +542,124 @@ class MpiRequestPool {
       @param task
    */
   void pushRecv(MpiRecvTask* task);
+  /** Send the result of a stolen task back, and delete the task once done.
+
+      This is called by \a MpiStolenTask::call().
+   */
+  void pushStolenResult(MpiStolenTask* task);
+  /** Note that all the local tasks are done, but for the ones stolen by
+      other ranks. This is called by TaskScheduler, see
+      TaskScheduler::stealing.
+   */
+  void localTasksDone();
+  /** Number of sends forced past the byte caps after \a maxThrottleDelay. */
+  size_t forcedSendCount() const { return forcedSends; }
 
  private:
-  /** Process a completed request.
+  /** Process a completed request, that is no longer in \a detached.
+   */
+  void processCompletedRequest(Request* r);
+  /** Path of a SEND, from its size and Data::packsByRange(). */
+  SendPath choosePath(Request* r) const;
+  /** Take a slot of the (to, tag) pair of a SEND, and set its path, with
+      \a slotMutex held.
+
+      @return false if the pair has \a maxSendsInFlight sends in flight, or
+      sends on another path
+   */
+  bool takeSlot(Request* r);
+  /** Does a SEND fit under the byte caps ? */
+  bool admitSend(Request* r) const;
+  /** Pack and issue a SEND, whose byte caps are checked. */
+  void issueSend(Request* r);
+  /** Pack and issue a SEND from the thread running its task, with
+      \a directPosting.
+
+      @return false if the send must go through the MPI thread instead
+   */
+  bool postSend(Request* r);
+  /** Match and issue a RECV from the thread running its task, with
+      \a directPosting.
 
-      @param it an iterator inside the \a detached list.
+      @return false if the receive must go through the MPI thread instead
    */
-  std::list<Request*>::iterator processCompletedRequest(
-      std::list<Request*>::iterator it);
+  bool postRecv(Request* r);
+  /** Add the \a posted requests to \a detached. Called with
+      \a pendingMutex held. */
+  void adoptPosted();
+  /** Issue the throttled sends that now fit under the caps.
+
+      @return true if a send was issued
+   */
+  bool issueThrottled();
   /** Test all the requests in the \a detached list.
 
-      Calls \a processCompletedRequest() on completed requests.
+      Probes for the messages of the \a unmatched requests, and calls \a
+      processCompletedRequest() on the requests completed according to
+      MPI_Testsome().
+
+      @return true if anything progressed
    */
-  void testDetachedRequests();
+  bool testDetachedRequests();
   /** Submit a request to MPI and put it into \a detached.
    */
   void pushDetachedRequest(Request* r);
+  /** Issue a SEND that holds a slot of its (to, tag) pair, or throttle it. */
+  void startSend(Request* r);
+  /** Add a request to \a detached.
+
+      @return its MPI request, to be set by the caller
+   */
+  MPI_Request* attach(Request* r);
+  /** Send the outbox of \a to as a BATCH. */
+  void flush(int to);
+  /** Send the outboxes that are allowed to.
+
+      @return true if a batch was sent
+   */
+  bool flushOutboxes();
+  /** Receive and demultiplex the arrived batches.
+
+      @return true if a batch was received
+   */
+  bool receiveBatches();
+  /** Complete a RECV from a part of a batch. */
+  void deliver(Request* r, const void* ptr, size_t count);
+  /** Match the messages of the \a unmatched requests.
+
+      @return true if a message was matched
+   */
+  bool matchReceives();
+  /** Match and receive the next chunks of a chunked RECV, as long as there
+      are free chunk buffers.
+
+      @return true if a chunk was matched
+   */
+  bool receiveChunks(Request* r);
+  /** Issue the next chunks of the \a chunkedSends, as long as there are free
+      chunk buffers.
+
+      @return true if a chunk was sent
+   */
+  bool sendChunks();
+  /** Take a buffer from the chunk pool.
+
+      @param send true for a send, which may only take half of the pool
+      @return NULL if the pool is exhausted
+   */
+  void* acquireChunkBuffer(bool send);
+  void releaseChunkBuffer(void* ptr, bool send);
+  /** Complete the task of a SEND request whose data is packed, while the
+      request itself is still in flight. */
+  void releaseSender(Request* r);
+  /** Send a message of the stealing protocol. */
+  void sendSteal(int to, int type, int id, const std::vector<char>& payload);
+  /** Answer the messages of the stealing protocol, ask for a task when we
+      are idle, and detect the end of the tasks of all the ranks.
+
+      @return true if anything progressed
+   */
+  bool progressStealing();
 
  public:
   /** MPI thread entry point.
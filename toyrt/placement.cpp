@@ -0,0 +1,81 @@
+#include "placement.hpp"
+
+#include <cassert>
+
+#include "data.hpp"
+#include "mpi.hpp"
+
+PlacementEngine::PlacementEngine()
+    : messageCost(1.), byteCost(1. / (1024 * 1024)) {}
+
+void PlacementEngine::setSize(int size) {
+  load.assign(size, 0.);
+  byLoad.clear();
+  for (int rank = 0; rank < size; rank++) {
+    byLoad.insert(std::make_pair(0., rank));
+  }
+}
+
+double PlacementEngine::transferCost(const toyRT_DepsArray& params,
+                                     int rank) const {
+  MpiDataCache& cache = MpiRequestPool::getInstance().cache;
+  int messages = 0;
+  size_t bytes = 0;
+  for (const auto& p : params) {
+    Data* d = (Data*)p.first;
+    if (d->rank == rank) {
+      continue;
+    }
+    if (!cache.isValidOnNode(d, rank)) {
+      messages++;
+      bytes += d->size();
+    }
+    // Write back to the owner
+    if (p.second == toyRT_WRITE) {
+      messages++;
+      bytes += d->size();
+    }
+  }
+  return messages * messageCost + bytes * byteCost;
+}
+
+int PlacementEngine::place(const toyRT_DepsArray& params, double cost) const {
+  assert(!load.empty());
+  std::vector<int> candidates;
+  for (const auto& p : params) {
+    if (p.second == toyRT_WRITE) {
+      candidates.push_back(((Data*)p.first)->rank);
+      break;
+    }
+  }
+  for (const auto& p : params) {
+    candidates.push_back(((Data*)p.first)->rank);
+  }
+  candidates.push_back(byLoad.begin()->second);
+
+  int node = -1;
+  double best = 0.;
+  for (int rank : candidates) {
+    const double finish = load[rank] + cost + transferCost(params, rank);
+    if ((node == -1) || (finish < best)) {
+      node = rank;
+      best = finish;
+    }
+  }
+  return node;
+}
+
+double PlacementEngine::offloadCost(const toyRT_DepsArray& params) const {
+  size_t bytes = 0;
+  for (const auto& p : params) {
+    const size_t size = ((Data*)p.first)->size();
+    bytes += (p.second == toyRT_WRITE ? 2 * size : size);
+  }
+  return 2 * messageCost + bytes * byteCost;
+}
+
+void PlacementEngine::assign(int rank, double cost) {
+  byLoad.erase(std::make_pair(load[rank], rank));
+  load[rank] += cost;
+  byLoad.insert(std::make_pair(load[rank], rank));
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "task.hpp"
+
+/** Choice of the rank executing a task in TaskScheduler::insertMpiTask().
+
+    The predicted finish time of a task on a rank is the predicted load of the
+    rank, that is the sum of the Task::cost() of the tasks placed on it so far,
+    plus the cost of the task, plus the cost of the transfers it requires
+    there: \a messageCost per message and \a byteCost per byte. The engine
+    picks the candidate rank where the task finishes first.
+
+    The candidates are the owners of the parameters, the owner of the first
+    written one first, and the least loaded rank, so that placing a task costs
+    O(params^2 + log P) instead of a scan of all the ranks.
+
+    Every rank inserts the same tasks in the same order, and the choice only
+    depends on them and on the state of the MpiDataCache, so all the ranks
+    make the same one. Task::cost() and Data::size() must thus return the
+    same value on all the ranks.
+ */
+class PlacementEngine {
+ private:
+  /** Predicted load of each rank */
+  std::vector<double> load;
+  /** (load, rank) pairs, to find the least loaded rank */
+  std::set<std::pair<double, int> > byLoad;
+
+  /** Cost of the transfers needed to execute a task on \a rank. */
+  double transferCost(const toyRT_DepsArray& params, int rank) const;
+
+ public:
+  /** Cost of a message, in Task::cost() units. */
+  double messageCost;
+  /** Cost of a transferred byte, in Task::cost() units. */
+  double byteCost;
+
+  PlacementEngine();
+  /** Set the number of ranks, and reset the loads. */
+  void setSize(int size);
+  /** Choose the rank executing a task.
+
+      @param params the parameters of the task
+      @param cost its predicted cost
+   */
+  int place(const toyRT_DepsArray& params, double cost) const;
+  /** Cost of running a task on a rank that has none of its data: all the
+      parameters are sent there, and the written ones are sent back. Used to
+      decide whether a ready task is worth stealing, see
+      TaskScheduler::stealing. */
+  double offloadCost(const toyRT_DepsArray& params) const;
+  /** Account for a task placed on a rank. */
+  void assign(int rank, double cost);
+  /** Predicted load of a rank. */
+  double predictedLoad(int rank) const { return load[rank]; }
+};
@@ -1,6 +1,38 @@
 #include "scheduler.hpp"
 #include "dependencies.hpp"
 
+#include <vector>
+
+namespace {
+/** Scheduler::steal() on \a n queues, popped in order. */
+bool stealFromQueues(std::deque<TaskPtr>* queues, int n, TaskPtr& task,
+                     const std::function<bool(Task*, double)>& accept) {
+  // Total cost of the tasks before each one, in pop order.
+  std::vector<double> ahead;
+  double cost = 0.;
+  for (int i = 0; i < n; i++) {
+    for (TaskPtr t : queues[i]) {
+      ahead.push_back(cost);
+      if (t) cost += t->cost();
+    }
+  }
+  size_t k = ahead.size();
+  for (int i = n - 1; i >= 0; i--) {
+    for (size_t j = queues[i].size(); j-- > 0;) {
+      k--;
+      TaskPtr t = queues[i][j];
+      // NULL tasks stop the workers.
+      if (t && accept(t, ahead[k])) {
+        task = t;
+        queues[i].erase(queues[i].begin() + j);
+        return true;
+      }
+    }
+  }
+  return false;
+}
+}  // namespace
+
 void EagerScheduler::clear() {
   std::lock_guard<std::mutex> guard(mutex);
   q.clear();
@@ -26,6 +58,17 @@ bool EagerScheduler::tryPop(TaskPtr& task) {
   return false;
 }
 
+bool EagerScheduler::steal(TaskPtr& task,
+                           const std::function<bool(Task*, double)>& accept) {
+  std::lock_guard<std::mutex> guard(mutex);
+  if (!stealFromQueues(&q, 1, task, accept)) {
+    return false;
+  }
+  taskCount--;
+  if (recorder) recorder->record(taskCount);
+  return true;
+}
+
 void PriorityScheduler::clear() {
   std::lock_guard<std::mutex> guard(mutex);
   if (TaskScheduler::getInstance().verbose())
@@ -68,3 +111,79 @@ bool PriorityScheduler::tryPop(TaskPtr& task) {
            TaskScheduler::getInstance().getLocalization().c_str());
   return false;
 }
+
+bool PriorityScheduler::steal(
+    TaskPtr& task, const std::function<bool(Task*, double)>& accept) {
+  std::lock_guard<std::mutex> guard(mutex);
+  if (!stealFromQueues(q, PRIORITIES, task, accept)) {
+    return false;
+  }
+  taskCount--;
+  if (recorder) recorder->record(taskCount);
+  return true;
+}
+
+void ResidencyScheduler::clear() {
+  std::lock_guard<std::mutex> guard(mutex);
+  q.clear();
+  taskCount = 0;
+}
+
+void ResidencyScheduler::push(TaskPtr task) {
+  std::lock_guard<std::mutex> guard(mutex);
+  q.push_back(task);
+  taskCount++;
+  if (recorder) recorder->record(taskCount);
+}
+
+bool ResidencyScheduler::tryPop(TaskPtr& task) {
+  TaskScheduler& s = TaskScheduler::getInstance();
+  const size_t inCore = s.inCoreSize();
+  const size_t available =
+      s.maxMemorySize - std::min(inCore, s.maxMemorySize);
+  std::lock_guard<std::mutex> guard(mutex);
+  if (q.empty()) {
+    return false;
+  }
+  size_t best = 0;
+  // (bytes to evict, -bytes in core, priority) of the best task
+  size_t bestEvicted = 0, bestResident = 0;
+  int bestPriority = PRIORITIES;
+  const size_t n = std::min(window, q.size());
+  for (size_t i = 0; i < n; i++) {
+    TaskPtr t = q[i];
+    // NULL tasks, which stop the workers, are only pushed once all the
+    // tasks are done.
+    if (!t) continue;
+    size_t resident = 0, swapped = 0;
+    t->residency(resident, swapped);
+    const size_t evicted = swapped - std::min(swapped, available);
+    const int priority = t->priority;
+    if ((bestPriority == PRIORITIES) || (evicted < bestEvicted) ||
+        ((evicted == bestEvicted) &&
+         ((resident > bestResident) ||
+          ((resident == bestResident) && (priority < bestPriority))))) {
+      best = i;
+      bestEvicted = evicted;
+      bestResident = resident;
+      bestPriority = priority;
+    }
+  }
+  task = q[best];
+  q.erase(q.begin() + best);
+  taskCount--;
+  if (recorder) recorder->record(taskCount);
+  return true;
+}
+
+bool ResidencyScheduler::steal(
+    TaskPtr& task, const std::function<bool(Task*, double)>& accept) {
+  std::lock_guard<std::mutex> guard(mutex);
+  // The push order stands for the pop order, that depends on the residency.
+  if (!stealFromQueues(&q, 1, task, accept)) {
+    return false;
+  }
+  taskCount--;
+  if (recorder) recorder->record(taskCount);
+  return true;
+}
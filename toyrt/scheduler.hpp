@@ -1,5 +1,7 @@
 #pragma once
+#include <atomic>
 #include <deque>
+#include <functional>
 #include <mutex>
 
 #include "context/data_recorder.hpp"
@@ -14,7 +16,7 @@
 class Scheduler {
  protected:
   TimedDataRecorder<int>* recorder;
-  int taskCount;
+  std::atomic<int> taskCount;
 
  public:
   Scheduler(TimedDataRecorder<int>* _recorder = NULL)
@@ -26,6 +28,23 @@ class Scheduler {
   virtual void push(TaskPtr task) = 0;
   /** Try to pop a task. See \a Queue<T>::tryPop(). */
   virtual bool tryPop(TaskPtr& task) = 0;
+  /** Remove a task to run it on another rank, see TaskScheduler::stealing.
+
+      The tasks are tried from the last one to be popped, as they would wait
+      the longest.
+
+      @param task set to the removed task
+      @param accept predicate on a task and the total Task::cost() of the
+      tasks that would be popped before it
+      @return false if no task is accepted, or if the scheduler doesn't
+      support it (default)
+   */
+  virtual bool steal(TaskPtr& task,
+                     const std::function<bool(Task*, double)>& accept) {
+    return false;
+  }
+  /** Number of tasks in the scheduler. */
+  int size() const { return taskCount; }
 };
 
 /** Simple FIFO scheduler.
@@ -41,6 +60,8 @@ class EagerScheduler : public Scheduler {
   void clear();
   void push(TaskPtr task);
   bool tryPop(TaskPtr& task);
+  bool steal(TaskPtr& task,
+             const std::function<bool(Task*, double)>& accept) override;
 };
 
 /** Simple FIFO scheduler with priorities (several FIFOs).
@@ -56,4 +77,32 @@ class PriorityScheduler : public Scheduler {
   void clear();
   void push(TaskPtr task);
   bool tryPop(TaskPtr& task);
+  bool steal(TaskPtr& task,
+             const std::function<bool(Task*, double)>& accept) override;
+};
+
+/** Scheduler preferring the tasks whose data are in core.
+
+    The first \a window tasks, in push order, are ranked by the size of the data
+    that would have to be evicted to fetch their swapped parameters (the
+    smaller the better), then by the size of their parameters that are in
+    core (the larger the better), then by priority. This reduces the swap
+    traffic when the memory is tight, at the cost of a scan on each pop.
+ */
+class ResidencyScheduler : public Scheduler {
+ private:
+  std::deque<TaskPtr> q;
+  std::mutex mutex;
+
+ public:
+  /** Number of tasks considered by tryPop(). Defaults to 64. */
+  size_t window;
+
+  ResidencyScheduler(TimedDataRecorder<int>* recorder = NULL)
+      : Scheduler(recorder), window(64) {}
+  void clear();
+  void push(TaskPtr task);
+  bool tryPop(TaskPtr& task);
+  bool steal(TaskPtr& task,
+             const std::function<bool(Task*, double)>& accept) override;
 };
@@ -62,3 +62,16 @@ bool Task::isReady() const {
   }
   return true;
 }
+
+void Task::residency(size_t& resident, size_t& swapped) const {
+  resident = 0;
+  swapped = 0;
+  for (auto& p : params) {
+    Data* d = (Data*)p.first;
+    if (ACCESS_ONCE(d->swapped)) {
+      swapped += d->oldSize;
+    } else {
+      resident += d->oldSize;
+    }
+  }
+}
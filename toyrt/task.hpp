@@ -31,16 +31,39 @@ class Task {
  public:
   static void execute(Task* t, TaskTimeline* timeline = NULL);
   bool isReady() const;
+  /** Total size of the parameters that are in core, and swapped out.
+
+      This is a hint, as the swaps are not synchronized with this call.
+   */
+  void residency(size_t& resident, size_t& swapped) const;
   /** Return extra data.
 
       The data returned have to be formatted as JSON, to be used by the timeline
       JSON output.
    */
   virtual std::string extraData() const { return std::string("{}"); }
+  /** Size of the temporary memory used by the task, in bytes.
+
+      The working set of the task is the size of its parameters plus this. It
+      is used by the admission control, see TaskScheduler::admissionControl.
+   */
+  virtual size_t scratchSize() const { return 0; }
+  /** Predicted execution time of the task, in arbitrary units.
+
+      It is used to balance the load of the ranks, see PlacementEngine, and
+      must be the same on all the ranks. Defaults to 1.
+   */
+  virtual double cost() const { return 1.; }
+  /** Parameters and access modes of the task. */
+  const toyRT_DepsArray& parameters() const { return params; }
 
  private:
   toyRT_DepsArray params;
   int index;
+  /** Index of the task among the ones inserted by
+      TaskScheduler::insertMpiTask(), the same on all the ranks, if it can be
+      stolen. -1 otherwise. */
+  int stealId;
   void* submittingContext;  // Node where the task is created (and probably
                             // submitted)
 
@@ -67,6 +90,19 @@ immediately after).
     */
   bool noPrefetch;
 
+ private:
+  /*! \brief true if the data of the task were prefetched before it became
+     ready, by TaskScheduler::lookaheadPrefetch().
+    */
+  bool prefetched;
+  /*! \brief Bytes accounted in the lookahead budget for this task.
+    */
+  size_t lookaheadSize;
+  /*! \brief true once TaskScheduler::startPrefetch() has been called for the
+     task.
+    */
+  bool pinned;
+
  public:
   std::string name;
   Priority priority;
@@ -74,10 +110,14 @@ immediately after).
  public:
   Task(std::string _name = "Task")
       : index(-1),
+        stealId(-1),
         submittingContext(trace::Node::currentReference()),
         doPostExecution(true),
         isCallback(false),
         noPrefetch(false),
+        prefetched(false),
+        lookaheadSize(0),
+        pinned(false),
         name(_name),
         priority(NORMAL) {}
   virtual ~Task() {}
@@ -0,0 +1,337 @@
+#include "tiers.hpp"
+#include "config.h"
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+#include "compression.hpp"
+
+CompressedMemoryTier::CompressedMemoryTier(std::unique_ptr<IoBackend> backend,
+                                           size_t budget, size_t elementSize)
+    : backend(std::move(backend)),
+      elementSize(elementSize),
+      usedSize(0),
+      hits(0),
+      misses(0),
+      demotedBytes(0),
+      budget(budget) {
+  assert(this->backend);
+}
+
+CompressedMemoryTier::~CompressedMemoryTier() {
+  lru.clear();
+  for (auto& p : entries) {
+    free(p.second->frame);
+  }
+}
+
+void CompressedMemoryTier::removeEntry(Data* d) {
+  auto it = entries.find(d);
+  if (it == entries.end()) {
+    return;
+  }
+  Entry* e = it->second.get();
+  lru.remove(e);
+  usedSize -= e->size;
+  free(e->frame);
+  entries.erase(it);
+}
+
+void CompressedMemoryTier::demote() {
+  while (usedSize > budget && !lru.empty()) {
+    Entry* e = lru.removeOldest();
+    backend->writeBuffer(e->d, e->frame, e->size);
+    demotedBytes += e->size;
+    usedSize -= e->size;
+    free(e->frame);
+    entries.erase(e->d);
+  }
+}
+
+void CompressedMemoryTier::deleteData(Data* d) {
+  removeEntry(d);
+  backend->deleteData(d);
+}
+
+void CompressedMemoryTier::writeBuffer(Data* d, const void* ptr, size_t size) {
+  removeEntry(d);
+  void* frame;
+  size_t frameSize = compression::compress(ptr, size, elementSize, &frame);
+  if (frameSize > budget) {
+    // Would evict the whole pool for nothing.
+    backend->writeBuffer(d, frame, frameSize);
+    demotedBytes += frameSize;
+    free(frame);
+    return;
+  }
+  Entry* e = new Entry();
+  e->d = d;
+  e->frame = frame;
+  e->size = frameSize;
+  entries[d].reset(e);
+  lru.put(e);
+  usedSize += frameSize;
+  demote();
+}
+
+size_t CompressedMemoryTier::readBuffer(Data* d, void** ptr) {
+  auto it = entries.find(d);
+  if (it != entries.end()) {
+    Entry* e = it->second.get();
+    lru.put(e);
+    hits++;
+    return compression::decompress(e->frame, e->size, ptr);
+  }
+  misses++;
+  void* frame = NULL;
+  size_t frameSize = backend->readBuffer(d, &frame);
+  size_t size = compression::decompress(frame, frameSize, ptr);
+  free(frame);
+  return size;
+}
+
+TieredIoBackend::TieredIoBackend()
+    : pendingJobs(0), stripeThreshold(4 * 1024 * 1024) {}
+
+TieredIoBackend::~TieredIoBackend() {
+  for (auto& tier : tiers) {
+    {
+      std::lock_guard<std::mutex> lock(tier->mutex);
+      tier->stop = true;
+    }
+    tier->wake.notify_one();
+    tier->thread.join();
+  }
+  while (!placements.empty()) {
+    removeChunks(placements.begin()->first);
+  }
+  for (size_t t = 0; t < tiers.size(); t++) {
+    rmdir(tiers[t]->directory.c_str());
+    std::string prefix = "tier" + std::to_string(t);
+    tiers[t]->writtenRecorder.toFile((prefix + "_written.txt").c_str());
+    tiers[t]->readRecorder.toFile((prefix + "_read.txt").c_str());
+  }
+}
+
+void TieredIoBackend::addTier(const char* directory, size_t capacity,
+                              double weight) {
+  assert(weight > 0);
+  std::unique_ptr<Tier> tier(new Tier());
+  std::string pattern = std::string(directory) + "/toyrt_tier_XXXXXX";
+  std::vector<char> name(pattern.begin(), pattern.end());
+  name.push_back('\0');
+  char* created = mkdtemp(name.data());
+  assert(created);
+  tier->directory = name.data();
+  tier->capacity = capacity ? capacity : SIZE_MAX;
+  tier->weight = weight;
+  tier->usedSize = 0;
+  tier->index = 0;
+  tier->stop = false;
+  tier->thread = std::thread(&TieredIoBackend::tierLoop, this, tier.get());
+  // Keep the tiers sorted by decreasing weight.
+  auto it = std::find_if(
+      tiers.begin(), tiers.end(),
+      [weight](const std::unique_ptr<Tier>& t) { return t->weight < weight; });
+  tiers.insert(it, std::move(tier));
+  for (size_t t = 0; t < tiers.size(); t++) {
+    for (Chunk* c = tiers[t]->lru.peekOldest(); c; c = c->lruHook.next) {
+      c->tier = t;
+    }
+  }
+}
+
+size_t TieredIoBackend::freeSize(int t) const {
+  // The slowest tier may be filled past its capacity.
+  const Tier& tier = *tiers[t];
+  return (tier.usedSize < tier.capacity) ? tier.capacity - tier.usedSize : 0;
+}
+
+bool TieredIoBackend::makeRoom(int t, size_t size) {
+  if (size > tiers[t]->capacity) {
+    return false;
+  }
+  while (freeSize(t) < size) {
+    Chunk* c = tiers[t]->lru.peekOldest();
+    if ((t + 1 == (int)tiers.size()) || !c || !makeRoom(t + 1, c->size)) {
+      return false;
+    }
+    demote(c);
+  }
+  return true;
+}
+
+void TieredIoBackend::demote(Chunk* c) {
+  std::vector<char> buffer(c->size);
+  readChunk(c, buffer.data());
+  Tier& from = *tiers[c->tier];
+  from.lru.remove(c);
+  from.usedSize -= c->size;
+  remove(c->filename.c_str());
+  Tier& to = *tiers[c->tier + 1];
+  c->tier++;
+  c->filename = to.directory + "/" + std::to_string(to.index++);
+  to.usedSize += c->size;
+  // Demoted data are the coldest of their new tier as well.
+  to.lru.putAsOldest(c);
+  writeChunk(c, buffer.data());
+}
+
+void TieredIoBackend::addChunk(Data* d, int t, size_t offset, size_t size) {
+  Tier& tier = *tiers[t];
+  Chunk* c = new Chunk();
+  c->d = d;
+  c->tier = t;
+  c->offset = offset;
+  c->size = size;
+  c->filename = tier.directory + "/" + std::to_string(tier.index++);
+  tier.usedSize += size;
+  tier.lru.put(c);
+  placements[d].emplace_back(c);
+}
+
+void TieredIoBackend::writeChunk(Chunk* c, const void* ptr) {
+  FILE* f = fopen(c->filename.c_str(), "wb");
+  assert(f);
+  size_t written = fwrite(ptr, 1, c->size, f);
+  assert(written == c->size);
+  fclose(f);
+  tiers[c->tier]->writtenRecorder.recordSynchronized(c->size);
+}
+
+void TieredIoBackend::readChunk(Chunk* c, void* ptr) {
+  FILE* f = fopen(c->filename.c_str(), "rb");
+  assert(f);
+  size_t readSize = fread(ptr, 1, c->size, f);
+  assert(readSize == c->size);
+  fclose(f);
+  tiers[c->tier]->readRecorder.recordSynchronized(c->size);
+}
+
+void TieredIoBackend::removeChunks(Data* d) {
+  auto it = placements.find(d);
+  if (it == placements.end()) {
+    return;
+  }
+  for (auto& c : it->second) {
+    Tier& tier = *tiers[c->tier];
+    tier.lru.remove(c.get());
+    tier.usedSize -= c->size;
+    remove(c->filename.c_str());
+  }
+  placements.erase(it);
+}
+
+void TieredIoBackend::writeBuffer(Data* d, const void* ptr, size_t size) {
+  assert(!tiers.empty());
+  removeChunks(d);
+  const int n = tiers.size();
+  bool striped = false;
+  if ((size >= stripeThreshold) && (n > 1)) {
+    double totalWeight = 0.;
+    for (auto& t : tiers) {
+      totalWeight += t->weight;
+    }
+    std::vector<size_t> stripes(n);
+    size_t offset = 0;
+    striped = true;
+    for (int t = 0; t < n; t++) {
+      stripes[t] = (t == n - 1) ? size - offset
+                                : (size_t)(size * tiers[t]->weight / totalWeight);
+      offset += stripes[t];
+      striped = striped && (stripes[t] <= freeSize(t));
+    }
+    if (striped) {
+      offset = 0;
+      for (int t = 0; t < n; t++) {
+        if (stripes[t]) {
+          addChunk(d, t, offset, stripes[t]);
+        }
+        offset += stripes[t];
+      }
+    }
+  }
+  if (!striped) {
+    // Fastest tier on which room can be made, demoting colder data.
+    int t = 0;
+    while ((t < n) && !makeRoom(t, size)) {
+      t++;
+    }
+    if (t == n) {
+      // Every tier is full: overflow the slowest one.
+      t = n - 1;
+    }
+    addChunk(d, t, 0, size);
+  }
+
+  transferChunks(placements[d], [this, ptr](Chunk* c) {
+    writeChunk(c, (const char*)ptr + c->offset);
+  });
+}
+
+size_t TieredIoBackend::readBuffer(Data* d, void** ptr) {
+  auto it = placements.find(d);
+  assert(it != placements.end());
+  auto& chunks = it->second;
+  size_t size = 0;
+  for (auto& c : chunks) {
+    size += c->size;
+    tiers[c->tier]->lru.put(c.get());
+  }
+  *ptr = malloc(size);
+  assert(*ptr || !size);
+  transferChunks(chunks, [this, ptr](Chunk* c) {
+    readChunk(c, (char*)*ptr + c->offset);
+  });
+  return size;
+}
+
+void TieredIoBackend::tierLoop(Tier* tier) {
+  std::unique_lock<std::mutex> lock(tier->mutex);
+  while (true) {
+    tier->wake.wait(lock,
+                    [tier]() { return tier->stop || !tier->jobs.empty(); });
+    if (tier->jobs.empty()) {
+      return;
+    }
+    std::function<void()> job = std::move(tier->jobs.front());
+    tier->jobs.pop_front();
+    lock.unlock();
+    job();
+    lock.lock();
+  }
+}
+
+void TieredIoBackend::transferChunks(
+    const std::vector<std::unique_ptr<Chunk> >& chunks,
+    const std::function<void(Chunk*)>& f) {
+  {
+    std::lock_guard<std::mutex> lock(pendingMutex);
+    pendingJobs = chunks.size() - 1;
+  }
+  for (size_t i = 1; i < chunks.size(); i++) {
+    Chunk* c = chunks[i].get();
+    Tier& tier = *tiers[c->tier];
+    {
+      std::lock_guard<std::mutex> lock(tier.mutex);
+      tier.jobs.push_back([this, c, &f]() {
+        f(c);
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        if (--pendingJobs == 0) {
+          pendingDone.notify_one();
+        }
+      });
+    }
+    tier.wake.notify_one();
+  }
+  f(chunks[0].get());
+  std::unique_lock<std::mutex> lock(pendingMutex);
+  pendingDone.wait(lock, [this]() { return pendingJobs == 0; });
+}
@@ -0,0 +1,159 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "context/data_recorder.hpp"
+#include "disk.hpp"
+#include "lru.hpp"
+
+/** Compressed in-memory tier between the in-core data and another backend.
+
+    The swapped data are compressed (see compression::compress()) and kept in
+    RAM as long as the compressed pool fits in its own byte budget. When it
+    doesn't, the least recently used entries are demoted, still compressed, to
+    the next backend (usually a FileIoBackend). Reading a data from the pool
+    only costs a decompression.
+
+    The pool keeps its copy after a read, since a clean data is dropped from
+    core without being written again. Like every backend, it is only used by
+    the IO thread.
+ */
+class CompressedMemoryTier : public IoBackend {
+ private:
+  struct Entry {
+    Data* d;
+    void* frame;
+    size_t size;
+    LruHook<Entry> lruHook;
+  };
+  std::unique_ptr<IoBackend> backend;
+  size_t elementSize;
+  std::unordered_map<Data*, std::unique_ptr<Entry> > entries;
+  Lru<Entry> lru;
+  size_t usedSize;
+  std::atomic<size_t> hits, misses, demotedBytes;
+
+  void removeEntry(Data* d);
+  /** Demote entries to the next backend until the pool fits its budget. */
+  void demote();
+
+ public:
+  /** Budget of the compressed pool, in bytes. */
+  size_t budget;
+
+  /** Constructor.
+
+      @param backend the backend receiving the demoted entries
+      @param budget size of the compressed pool in bytes
+      @param elementSize shuffle width of the compression
+   */
+  CompressedMemoryTier(std::unique_ptr<IoBackend> backend, size_t budget,
+                       size_t elementSize = sizeof(double));
+  ~CompressedMemoryTier();
+  void deleteData(Data* d);
+  void writeBuffer(Data* d, const void* ptr, size_t size);
+  size_t readBuffer(Data* d, void** ptr);
+  /** Number of reads served by the pool. */
+  size_t poolHits() const { return hits; }
+  /** Number of reads served by the next backend. */
+  size_t poolMisses() const { return misses; }
+  /** Total size of the entries demoted to the next backend. */
+  size_t demotedSize() const { return demotedBytes; }
+};
+
+/** Backend spreading the swapped data over several storage tiers.
+
+    Each tier is a directory (typically on its own device) with a capacity and
+    a bandwidth weight. The data are written to the fastest tier, i.e. the one
+    with the largest weight, and the least recently used data of a full tier
+    are demoted to the next one to make room. When no tier has room left, the
+    data go to the slowest tier past its capacity.
+    Objects larger than \a stripeThreshold are striped over all the tiers, with
+    stripes proportional to the tier weights, and the stripes are transferred
+    in parallel, each by the IO thread of its tier.
+
+    The traffic of each tier is recorded and dumped to tier<i>_written.txt and
+    tier<i>_read.txt, where i is the rank of the tier by decreasing weight.
+ */
+class TieredIoBackend : public IoBackend {
+ private:
+  /** Part of a data stored on a tier. */
+  struct Chunk {
+    Data* d;
+    int tier;
+    size_t offset;  ///< Offset of the chunk in the data buffer
+    size_t size;
+    std::string filename;
+    LruHook<Chunk> lruHook;
+  };
+  struct Tier {
+    std::string directory;
+    size_t capacity;
+    double weight;
+    size_t usedSize;
+    int index;  ///< Counter for the file names
+    Lru<Chunk> lru;
+    TimedDataRecorder<size_t> writtenRecorder, readRecorder;
+    /** IO thread of the tier, transferring its stripes. */
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<std::function<void()> > jobs;
+    bool stop;
+  };
+  std::vector<std::unique_ptr<Tier> > tiers;
+  std::unordered_map<Data*, std::vector<std::unique_ptr<Chunk> > > placements;
+  /** Stripes still being transferred by the tier threads. */
+  size_t pendingJobs;
+  std::mutex pendingMutex;
+  std::condition_variable pendingDone;
+
+  size_t freeSize(int t) const;
+  /** Demote data from tier t and the next ones until t has \a size bytes
+      free.
+
+      @return false if the slower tiers are full as well
+   */
+  bool makeRoom(int t, size_t size);
+  /** Move a chunk from its tier to the next one. */
+  void demote(Chunk* c);
+  void addChunk(Data* d, int t, size_t offset, size_t size);
+  void writeChunk(Chunk* c, const void* ptr);
+  void readChunk(Chunk* c, void* ptr);
+  void removeChunks(Data* d);
+  void tierLoop(Tier* tier);
+  /** Call f on every chunk of a data, the first one in the calling thread
+      and the others in the threads of their tiers, and wait for all of them.
+   */
+  void transferChunks(const std::vector<std::unique_ptr<Chunk> >& chunks,
+                      const std::function<void(Chunk*)>& f);
+
+ public:
+  /** Objects at least this large are striped over all the tiers. */
+  size_t stripeThreshold;
+
+  TieredIoBackend();
+  ~TieredIoBackend();
+  /** Add a storage tier.
+
+      @param directory directory in which a temporary directory is created
+      @param capacity capacity in bytes, 0 for no limit
+      @param weight relative bandwidth of the tier
+   */
+  void addTier(const char* directory, size_t capacity, double weight);
+  void deleteData(Data* d) { removeChunks(d); }
+  void writeBuffer(Data* d, const void* ptr, size_t size);
+  size_t readBuffer(Data* d, void** ptr);
+  /** Bytes currently stored on a tier, by decreasing weight. */
+  size_t tierUsedSize(int t) const { return tiers[t]->usedSize; }
+  int tierCount() const { return tiers.size(); }
+};
@@ -7,9 +7,23 @@ void Worker::mainLoop() {
     DECLARE_CONTEXT;
 
     TaskPtr task;
+    // Tasks refused by admitTask() during the current pass over the queue.
+    std::vector<TaskPtr> rejected;
     int spinCounter = 1;
     while (true) {
       bool notEmpty = q.tryPop(task);
+      size_t scratch = 0;
+      // A task that can't be admitted is set aside, and the next one is tried
+      // right away. The worker only backs off once the whole queue has been
+      // refused.
+      if (notEmpty && task && !scheduler.admitTask(task, scratch)) {
+        rejected.push_back(task);
+        continue;
+      }
+      for (TaskPtr t : rejected) {
+        q.push(t);
+      }
+      rejected.clear();
       if (!notEmpty) {
         // Exponential backoff
         for (int i = 0; i < spinCounter; i++) {
@@ -34,6 +48,7 @@ void Worker::mainLoop() {
         q.push(task);
       } else {
         Task::execute(task, &timeline);
+        scheduler.releaseTask(scratch);
       }
     }
   }